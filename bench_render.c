@@ -0,0 +1,250 @@
+/* ===================================================================
+ * bench_render.c
+ * 描画処理のホスト用ベンチマーク
+ *
+ * 概要:
+ * tetris_main.c をそのまま取り込み、カーネル/モニタ依存の関数を
+ * スタブに置き換えてホスト(Linux)上で display() を実行する。
+ * 出力はメモリストリームに書き込み、1フレームあたりの送信バイト数を
+ * カラープロファイル毎に表示する。
+ * あわせて、セル描画 (print_cell_content) の1秒あたりのセル数を測る。
+ *
+ * ビルド: make -f Makefile.host bench
+ * =================================================================== */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mtk_c.h"
+
+/* tetris_main.c の main と衝突しないよう名前を変えて取り込む */
+#define main tetris_target_main
+#include "tetris_main.c"
+#undef main
+
+/* -------------------------------------------------------------------
+ * カーネル/モニタ関数のスタブ
+ * ------------------------------------------------------------------- */
+TASK_ID_TYPE curr_task;
+volatile unsigned long tick = 0;
+volatile unsigned long port_tx_bytes[NUMPORT];
+SEMAPHORE_TYPE semaphore[NUMSEMAPHORE];
+
+void init_kernel(void) {}
+void set_task(void (*func)()) { (void)func; }
+void begin_sch(void) {}
+int  inbyte(int ch) { (void)ch; return -1; }
+void skipmt(void) { tick++; }
+void sleep_until(unsigned long t) { while (tick < t) skipmt(); }
+void mtk_timer_start(MtkTimer *t, unsigned long delay, unsigned long period,
+                     void (*func)(void *arg), void *arg) { (void)t; (void)delay; (void)period; (void)func; (void)arg; }
+void timer_start_body(MtkTimer *t) { (void)t; }
+void timer_stop_body(MtkTimer *t) { (void)t; }
+unsigned long mtk_now_cycles(void) { return tick * (MTK_TIMER_HZ / MTK_TICK_HZ); }
+void P(int sem_id) { (void)sem_id; }
+void V(int sem_id) { (void)sem_id; }
+
+/* -------------------------------------------------------------------
+ * 計測用の出力先 (メモリストリーム)
+ * ------------------------------------------------------------------- */
+typedef struct {
+    FILE  *fp;
+    char  *buf;
+    size_t len;
+} BenchSink;
+
+void sink_open(BenchSink *sink) {
+    sink->buf = NULL; sink->len = 0;
+    sink->fp = open_memstream(&sink->buf, &sink->len);
+}
+
+void sink_close(BenchSink *sink) {
+    fclose(sink->fp);
+    free(sink->buf);
+}
+
+/* 前回呼び出し以降に書き込まれたバイト数 */
+size_t sink_take(BenchSink *sink) {
+    size_t n;
+    fflush(sink->fp);
+    n = sink->len;
+    rewind(sink->fp);
+    return n;
+}
+
+/* ===================================================================
+ * setup_game
+ * 途中局面を模したゲーム状態を作る
+ *
+ * 概要:
+ * 壁・床に加え、下から数段をミノの色で埋めた (穴あり) 盤面を作る。
+ * 乱数はゲームと同じ xorshift を固定シードで使い、毎回同じ局面を再現する。
+ * =================================================================== */
+void setup_game(TetrisGame *game, int port_id, FILE *fp, int profile, unsigned int seed)
+{
+    int i, j;
+    Rng rng;
+
+    memset(game, 0, sizeof(*game));
+    game->port_id = port_id;
+    game->fp_out = fp;
+    game->color_profile = profile;
+    game->state = GS_PLAYING;
+    game->target = 1 - port_id; /* 2人対戦の相手 */
+    game->opp_view_id = -1;
+
+    for (i = 0; i < FIELD_HEIGHT; i++) game->field[i][0] = game->field[i][FIELD_WIDTH - 1] = CELL_WALL;
+    for (j = 0; j < FIELD_WIDTH; j++) game->field[FIELD_HEIGHT - 1][j] = CELL_WALL;
+
+    rng_seed(&rng, seed);
+    for (i = FIELD_HEIGHT - 9; i < FIELD_HEIGHT - 1; i++) {
+        for (j = 1; j < FIELD_WIDTH - 1; j++) {
+            if (rng_range(&rng, 5)) game->field[i][j] = 2 + rng_range(&rng, MINO_TYPE_MAX);
+        }
+    }
+
+    rng_seed(&game->bag_rng, seed);
+    rng_seed(&game->aux_rng, seed);
+    fillBag(game); game->nextMinoType = game->bag[game->bag_index++]; resetMino(game);
+    memset(game->prevBuffer, -1, sizeof(game->prevBuffer));
+    memset(game->prevOpponentBuffer, -1, sizeof(game->prevOpponentBuffer));
+    game->own_force_rows = game->opp_force_rows = ALL_ROWS_MASK;
+    mark_field_rows(game, 0, FIELD_HEIGHT - 1);
+    term_invalidate(game);
+}
+
+/* ===================================================================
+ * bench_profile
+ * 1つのカラープロファイルについて送信バイト数を計測する
+ *
+ * 計測項目:
+ * full : 自分・相手の両フィールドを全再描画したときのバイト数
+ * move : ミノを1マス横移動したときの差分描画のバイト数
+ * rival : 相手画面だけを全再描画したときのバイト数 (通常表示)
+ * compact : 相手画面だけを縮小表示で全再描画したときのバイト数 (rival に対する割合も表示)
+ * =================================================================== */
+
+/* 相手画面だけを描き直させる (自分の画面・ヘッダは描画済みのまま) */
+size_t bench_rival_redraw(TetrisGame *game, BenchSink *sink, int view)
+{
+    game->rival_view = view;
+    memset(game->prevOpponentBuffer, -1, sizeof(game->prevOpponentBuffer));
+    memset(game->prevMiniBuffer, 0xFF, sizeof(game->prevMiniBuffer));
+    game->opp_force_rows = ALL_ROWS_MASK;
+    term_invalidate(game);
+    sink_take(sink);
+    display(game);
+    return sink_take(sink);
+}
+
+void bench_profile(int profile, const char *name)
+{
+    TetrisGame me, rival;
+    BenchSink my_sink, rival_sink;
+    size_t full, move, rival_full, compact;
+
+    sink_open(&my_sink);
+    sink_open(&rival_sink);
+    setup_game(&me, 0, my_sink.fp, profile, 1);
+    setup_game(&rival, 1, rival_sink.fp, profile, 2);
+    all_games[0] = &me;
+    all_games[1] = &rival;
+
+    /* 相手の描画バッファを構築しておく */
+    display(&rival);
+    sink_take(&rival_sink);
+
+    display(&me);
+    full = sink_take(&my_sink);
+
+    if (!isHit(&me, me.minoX - 1, me.minoY, me.minoType, me.minoAngle)) me.minoX--;
+    else me.minoX++;
+    mark_piece_dirty(&me);
+    display(&me);
+    move = sink_take(&my_sink);
+
+    rival_full = bench_rival_redraw(&me, &my_sink, RIVAL_VIEW_FULL);
+    compact = bench_rival_redraw(&me, &my_sink, RIVAL_VIEW_COMPACT);
+
+    printf("%-8s %12lu %12lu %12lu %14lu (%lu%%)\n", name, (unsigned long)full, (unsigned long)move,
+           (unsigned long)rival_full, (unsigned long)compact,
+           (unsigned long)(compact * 100 / rival_full));
+
+    all_games[0] = all_games[1] = NULL;
+    sink_close(&my_sink);
+    sink_close(&rival_sink);
+}
+
+/* -------------------------------------------------------------------
+ * 比較用: 表を使わない従来のセル描画 (グリフを if/else で選び fputs で送る)
+ * ------------------------------------------------------------------- */
+void print_cell_legacy(TetrisGame *game, char cellVal)
+{
+    const char *glyph;
+
+    if (cellVal == CELL_EMPTY)                glyph = GLYPH_EMPTY;
+    else if (cellVal == CELL_GHOST)           glyph = GLYPH_GHOST;
+    else if (cellVal >= 1 && cellVal <= 9)    glyph = GLYPH_BLOCK;
+    else                                      glyph = GLYPH_INVALID;
+    term_set_color(game, cell_palette(cellVal));
+    fputs(glyph, game->fp_out);
+    game->term.cur_x += 2;
+}
+
+double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* ===================================================================
+ * bench_cells
+ * セル描画の速度 (1秒あたりのセル数) を測る
+ *
+ * 概要:
+ * 途中局面の盤面 (ゴースト・操作中ミノを含む) を行順に描画し続ける。
+ * 色の切り替えは端末状態トラッカの判定どおりに起こる。
+ * 出力先は /dev/null (stdio のバッファ経由) で、回線の速度は含まない。
+ * =================================================================== */
+double bench_cells(int profile, void (*draw)(TetrisGame *, char))
+{
+    TetrisGame game;
+    FILE *fp = fopen("/dev/null", "w");
+    unsigned long cells = 0;
+    double start, elapsed;
+    int i, j, round;
+
+    setup_game(&game, 0, fp, profile, 1);
+    display(&game);
+    start = now_sec();
+    do {
+        for (round = 0; round < 100; round++) {
+            for (i = 0; i < FIELD_HEIGHT; i++) {
+                for (j = 0; j < FIELD_WIDTH; j++) draw(&game, pr_get(&game.displayBuffer[i], j));
+            }
+        }
+        cells += 100UL * FIELD_HEIGHT * FIELD_WIDTH;
+        elapsed = now_sec() - start;
+    } while (elapsed < 0.2);
+    fclose(fp);
+    return cells / elapsed;
+}
+
+int main(void)
+{
+    static const char *names[COLOR_PROFILE_MAX] = { "24bit", "256", "16" };
+    int p;
+
+    init_cell_seq();
+    printf("%-8s %12s %12s %12s %14s\n", "profile", "full[byte]", "move[byte]", "rival[byte]", "compact[byte]");
+    for (p = 0; p < COLOR_PROFILE_MAX; p++) bench_profile(p, names[p]);
+
+    printf("\n%-8s %14s %14s\n", "profile", "table[cell/s]", "legacy[cell/s]");
+    for (p = 0; p < COLOR_PROFILE_MAX; p++) {
+        printf("%-8s %14.0f %14.0f\n", names[p],
+               bench_cells(p, print_cell_content), bench_cells(p, print_cell_legacy));
+    }
+    return 0;
+}
@@ -9,6 +9,22 @@
  * =================================================================== */
 
 #include <stdarg.h>
+#include <stddef.h>
+#include "mtk_c.h"
+
+#ifdef MTK_HOST
+/* -------------------------------------------------------------------
+ * ホスト実行時 (make -f Makefile.host tetris_host)
+ * libc の read/write と衝突しないよう名前を変え、
+ * csys_fdopen() で作るストリームの入出力関数として使う。
+ * ------------------------------------------------------------------- */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#define read  csys_read
+#define write csys_write
+#define fcntl csys_fcntl
+#endif
 
 /* 外部関数の宣言 (アセンブリ言語で実装) */
 extern int inbyte(int ch);
@@ -16,10 +32,16 @@ extern void outbyte(int ch, unsigned char c);
 extern void skipmt(void); /* マルチタスク用: 強制タスク切り替え */
 
 /* -------------------------------------------------------------------
- * ファイルディスクリプタ(FD)とポートの対応定義
+ * ファイルディスクリプタ(FD)とポートの対応表
+ * 表にない FD と、NUMPORT 以上のポートに対応する FD は Port0 へ。
  * ------------------------------------------------------------------- */
-#define FD_PORT0 0  /* 標準入出力等は Port0 (UART1) へ */
-#define FD_PORT1 4  /* FD 4 は Port1 (UART2) へ */
+static const signed char fd_port_table[] = {
+    0, 0, 0,    /* FD 0〜2: 標準入出力等は Port0 (UART1) へ */
+    -1,         /* FD 3   : 未使用 */
+    1,          /* FD 4   : Port1 (UART2) */
+    2, 3        /* FD 5〜6: Port2, Port3 (ホスト実行時に NUMPORT を増やした場合) */
+};
+#define FD_TABLE_SIZE ((int)sizeof(fd_port_table))
 
 /* fcntl用定数 (必要な場合) */
 #ifndef F_GETFL
@@ -29,6 +51,27 @@ extern void skipmt(void); /* マルチタスク用: 強制タスク切り替え
 #define O_RDWR  2
 #endif
 
+/* -------------------------------------------------------------------
+ * 送信バイト数カウンタ (ポート毎)
+ * 実際に outbyte で送出したバイト数 (改行変換の \r を含む) を数える。
+ * アプリケーション側で送信スループットの実測に使用する。
+ * ------------------------------------------------------------------- */
+volatile unsigned long port_tx_bytes[NUMPORT];
+
+/* -------------------------------------------------------------------
+ * 送信データの写し (ポート毎. NULL=なし)
+ * 登録した関数は write() に渡されたデータ (改行変換前) を受け取る。
+ * アプリケーション側で観戦ポートへの配信に使用する。
+ * ------------------------------------------------------------------- */
+void (*port_tap[NUMPORT])(int ch, const char *buf, int nbytes);
+
+/* FD に対応するポート (チャンネル) 番号 */
+static int fd_port(int fd)
+{
+    int ch = (fd >= 0 && fd < FD_TABLE_SIZE) ? fd_port_table[fd] : 0;
+    return (ch >= 0 && ch < NUMPORT) ? ch : 0;
+}
+
 
 /* ===================================================================
  * read(fd, buf, nbytes)
@@ -49,11 +92,7 @@ int read(int fd, char *buf, int nbytes)
     /* ---------------------------------------------------------------
      * 1. ポート(チャンネル)の決定
      * --------------------------------------------------------------- */
-    if (fd == FD_PORT1) {
-        ch = 1; /* Port1 (UART2) */
-    } else {
-        ch = 0; /* Port0 (UART1) - デフォルト */
-    }
+    ch = fd_port(fd);
 
     /* ---------------------------------------------------------------
      * 2. 指定バイト数分の読み込みループ
@@ -123,23 +162,26 @@ int write (int fd, char *buf, int nbytes)
     /* ---------------------------------------------------------------
      * 1. ポート(チャンネル)の決定
      * --------------------------------------------------------------- */
-    if (fd == FD_PORT1) {
-        ch = 1;
-    } else {
-        ch = 0;
-    }
+    ch = fd_port(fd);
+
+    /* ---------------------------------------------------------------
+     * 2. 送信データの写し (登録されている場合)
+     * --------------------------------------------------------------- */
+    if (port_tap[ch] != NULL) port_tap[ch](ch, buf, nbytes);
 
     /* ---------------------------------------------------------------
-     * 2. 出力ループ
+     * 3. 出力ループ
      * --------------------------------------------------------------- */
     for (i = 0; i < nbytes; i++) {
         /* 改行コードの変換 (\n -> \r\n は必要に応じて調整) */
         if (*(buf + i) == '\n') {
             outbyte(ch, '\r');
+            port_tx_bytes[ch]++;
         }
         
         /* 1文字出力 */
         outbyte(ch, *(buf + i));
+        port_tx_bytes[ch]++;
         
         /* 簡易ウェイト (連続出力時のバッファ溢れ防止等のため) */
         for (j = 0; j < 300; j++);
@@ -163,4 +205,31 @@ int fcntl(int fd, int cmd, ...)
         return O_RDWR;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+
+#ifdef MTK_HOST
+/* ===================================================================
+ * csys_fdopen(fd, mode)
+ * ホスト実行時の fdopen の代わり
+ *
+ * 概要:
+ * 実機の newlib と同じく、ストリームの入出力が上の read/write を
+ * 経由するようにする (改行変換・送信バイト数の計数を含む)。
+ * =================================================================== */
+static ssize_t csys_cookie_read(void *cookie, char *buf, size_t size)
+{
+    return read((int)(long)cookie, buf, (int)size);
+}
+
+static ssize_t csys_cookie_write(void *cookie, const char *buf, size_t size)
+{
+    return write((int)(long)cookie, (char *)buf, (int)size);
+}
+
+FILE *csys_fdopen(int fd, const char *mode)
+{
+    cookie_io_functions_t io = { csys_cookie_read, csys_cookie_write, NULL, NULL };
+    return fopencookie((void *)(long)fd, mode, io);
+}
+#endif
@@ -0,0 +1,677 @@
+/* ===================================================================
+ * host_mtk.c
+ * マルチタスクカーネル ホスト (Linux) 実行用パート
+ *
+ * 概要:
+ * mtk_asm.s・inchrw.s・outchr.s とモニタ (TRAP #0) が受け持つ処理を
+ * Linux 上の機能で置き換える。mtk_c.c・csys68k.c・tetris_main.c は
+ * -DMTK_HOST を付けてそのままコンパイルする。
+ *
+ * - コンテキスト切り替え : ucontext (swapcontext)
+ * - Port0 (UART1)       : 標準入出力 (端末は raw モードに設定)
+ * - Port1 (UART2) 以降  : 擬似端末 (PTY). 起動時にスレーブ側の名前を表示する
+ *                          (-DNUMPORT=N で Port{N-1} まで増やせる)
+ * - タイマ割り込み       : TCN1 を CLOCK_MONOTONIC から求める。周期動作では
+ *                          50ms 毎の一致 (リスタートモード) を数え、
+ *                          ティックレス動作では TCMP1 を1回限りの SIGALRM で模擬する
+ * - LED                  : host_io_shadow (I/O 領域の代わりのメモリ)
+ * - シリアル回線モデル   : MTK_HOST_BAUD を指定すると、送信を実機の回線速度で
+ *                          送り出し、フレーム毎の遅延・送信待ちを記録する
+ *
+ * タイマ割り込み (周期動作の一致・ティックレス動作の SIGALRM) は保留として扱い、
+ * hard_clock_body() とタスク切り替えは次のカーネル入口
+ * (inbyte/outbyte/skipmt/P/V) で行う。シグナルハンドラの中 (libc の任意の
+ * 処理の途中) で切り替えないためである。
+ * ただし outbyte は csys68k.c の write から、つまり fflush などがストリームの
+ * ロックを保持している間に呼ばれるので、stdio の処理中にも切り替わる
+ * (実機で送信中にタイマ割り込みが入るのと同じ)。全タスクが1つのスレッドで
+ * 動くため、このロックは他のタスクを排除しない。1つのストリームには
+ * 1つのタスクだけが書くこと (各ポートのストリームはそのポートのタスクが書く)。
+ *
+ * ビルド: make -f Makefile.host tetris_host
+ * =================================================================== */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include "mtk_c.h"
+
+/* -------------------------------------------------------------------
+ * 外部関数の宣言 (mtk_c.c で定義されている関数)
+ * ------------------------------------------------------------------- */
+extern void hard_clock_body(int from_irq);
+extern void p_body(int sem_id);
+extern void v_body(int sem_id);
+extern void sleep_until_body(unsigned long t);
+extern volatile unsigned long port_tx_bytes[NUMPORT]; /* csys68k.c */
+
+/* -------------------------------------------------------------------
+ * 定数定義
+ * ------------------------------------------------------------------- */
+#define HOST_SKIPMT_USEC  1000  /* skipmt 1回あたりの待ち時間の既定値 */
+#define HOST_IO_SIZE      0x40  /* シャドウ領域の大きさ (LED 領域を含む) */
+#define HOST_KEY_EXIT     0x03  /* Port1 から Ctrl-C を受け取ったら終了する */
+#define HOST_TXQ_SIZE     256   /* 回線モデルの送信キュー (モニタの送信バッファ相当) */
+#define HOST_NS_PER_SEC   1000000000LL
+
+/* LED のオフセット (equdefs.inc の LED0〜LED7) */
+static const int host_led_offset[8] = { 0x39, 0x3b, 0x3d, 0x3f, 0x29, 0x2b, 0x2d, 0x2f };
+
+/* ===================================================================
+ * 大域変数
+ * =================================================================== */
+unsigned char host_io_shadow[HOST_IO_SIZE]; /* I/O 領域 (LED) のシャドウ */
+
+static ucontext_t host_ctx[NUMTASK + 1];    /* タスクのコンテキスト (ID=1から) */
+#ifdef MTK_TICKLESS
+static volatile sig_atomic_t host_clock_pending; /* タイマ割り込み保留 (SIGALRM) */
+#endif
+static volatile sig_atomic_t host_exit_pending;  /* 終了要求 (SIGINT/SIGTERM) */
+static int host_exiting;                         /* exit 処理中 (ストリームの掃き出し) */
+static long host_skipmt_usec = HOST_SKIPMT_USEC;
+
+static int host_in_fd[NUMPORT];             /* ポート毎の入力 FD */
+static int host_out_fd[NUMPORT];            /* ポート毎の出力 FD */
+static int host_pty_slave[NUMPORT];         /* Port1 以降のスレーブ側 (開いたままにする) */
+static struct termios host_saved_tio;       /* 起動時の端末設定 */
+static int host_tio_saved = 0;
+
+/* -------------------------------------------------------------------
+ * シリアル回線モデル (ポート毎)
+ * 送信キューの先頭から1文字ずつ char_ns かけて回線に出ていくものとし、
+ * 送り終わった時刻になったバイトだけを FD に書く。
+ * 時刻は CLOCK_MONOTONIC (ns)。
+ * ------------------------------------------------------------------- */
+typedef struct {
+    unsigned char q[HOST_TXQ_SIZE]; /* 回線に出ていないバイト (リングバッファ) */
+    int head, count;
+    long long busy_until;   /* キュー末尾のバイトを送り終わる時刻 */
+    long long in_ns;        /* 画面への反映を待っている最初の入力の時刻 (0=なし) */
+    unsigned long bytes;    /* 送信バイト数 */
+    unsigned long frame_bytes; /* 現在のフレームのバイト数 */
+    unsigned long frames;   /* フレーム数 */
+    unsigned long lat_count;
+    long long lat_sum, lat_max; /* 入力から画面反映 (送り終わり) までの時間 */
+    int backlog_max;        /* フレーム末尾での送信待ちバイト数の最大 */
+    unsigned long dropped;  /* 相手が読まないため捨てたバイト数 */
+} HostLine;
+
+static HostLine host_line[NUMPORT];
+static long long host_char_ns = 0;      /* 1文字の送信時間 (0=回線モデルなし) */
+static long host_baud = 0;
+static char host_framing[4] = "8N1";
+static long long host_start_ns;
+#ifndef MTK_TICKLESS
+static long long host_timer_base_ns;    /* タイマを開始した時刻 (TCN1 の 0) */
+static unsigned long host_timer_acked;  /* 処理した周期割り込みの数 */
+#endif
+static FILE *host_line_log = NULL;      /* フレーム境界の記録 (MTK_HOST_LINE_LOG) */
+
+static void host_line_report(void);
+
+
+/* ===================================================================
+ * host_exit
+ * 終了時の後始末
+ *
+ * 概要:
+ * 端末設定を元に戻し、最後の LED の状態とポート毎の送信バイト数を表示する。
+ * =================================================================== */
+static void host_exit(void)
+{
+    int i;
+
+    host_line_report();
+    if (host_tio_saved) tcsetattr(STDIN_FILENO, TCSANOW, &host_saved_tio);
+
+    fprintf(stderr, "\x1b[0m\x1b[?25h\nLED: [");
+    for (i = 0; i < 8; i++) {
+        unsigned char c = host_io_shadow[host_led_offset[i]];
+        fputc((c >= ' ' && c < 0x7f) ? c : ' ', stderr);
+    }
+    fprintf(stderr, "]  tick=%lu  tx:", tick);
+    for (i = 0; i < NUMPORT; i++) fprintf(stderr, " port%d=%lu", i, port_tx_bytes[i]);
+    fputc('\n', stderr);
+}
+
+/* ===================================================================
+ * host_line_setup
+ * 回線モデルの設定 (環境変数から)
+ *
+ * 概要:
+ * MTK_HOST_BAUD     : ボーレート (例: 9600, 38400, 115200. 未指定/0 で回線モデルなし)
+ * MTK_HOST_FRAMING  : キャラクタ構成 (例: 8N1, 7E1, 8N2. 既定 8N1)
+ * MTK_HOST_LINE_LOG : フレーム境界の記録ファイル
+ *                     (1行に ポート 時刻[us] バイト数 送信待ちバイト数)
+ * =================================================================== */
+static void host_line_setup(void)
+{
+    const char *env;
+    int data = 8, parity = 0, stop = 1;
+
+    env = getenv("MTK_HOST_FRAMING");
+    if (env != NULL && strlen(env) == 3 && env[0] >= '5' && env[0] <= '8' &&
+        strchr("NEO", env[1]) != NULL && (env[2] == '1' || env[2] == '2')) {
+        data = env[0] - '0';
+        parity = (env[1] != 'N');
+        stop = env[2] - '0';
+        strcpy(host_framing, env);
+    }
+    env = getenv("MTK_HOST_BAUD");
+    if (env != NULL) host_baud = atol(env);
+    if (host_baud > 0) {
+        /* スタートビット + データ + パリティ + ストップビット */
+        host_char_ns = (1 + data + parity + stop) * HOST_NS_PER_SEC / host_baud;
+    }
+    env = getenv("MTK_HOST_LINE_LOG");
+    if (env != NULL && (host_line_log = fopen(env, "w")) == NULL) perror(env);
+}
+
+/* 現在時刻 (ns) */
+static long long host_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * HOST_NS_PER_SEC + ts.tv_nsec;
+}
+
+/* FD への書き込み (相手が読まずに擬似端末が一杯なら、書けなかった分は捨てる) */
+/* 待つと唯一のスレッドが止まり、全てのタスク・ポートが止まるため */
+static void host_write_fd(int ch, const unsigned char *buf, int n)
+{
+    while (n > 0) {
+        ssize_t w = write(host_out_fd[ch], buf, n);
+        if (w > 0) { buf += w; n -= w; continue; }
+        if (w < 0 && errno == EINTR) continue;
+        host_line[ch].dropped += n;
+        return;
+    }
+}
+
+/* ===================================================================
+ * host_line_drain
+ * 時刻 now までに送り終わったバイトを FD に書き出す
+ * =================================================================== */
+static void host_line_drain(int ch, long long now)
+{
+    HostLine *l = &host_line[ch];
+    int left, done;
+
+    if (l->count == 0) return;
+    /* まだ送り終わっていないバイト数 (切り上げ) */
+    left = (now >= l->busy_until) ? 0 : (int)((l->busy_until - now + host_char_ns - 1) / host_char_ns);
+    done = l->count - left;
+    while (done > 0) {
+        int n = (l->head + done > HOST_TXQ_SIZE) ? HOST_TXQ_SIZE - l->head : done;
+        host_write_fd(ch, &l->q[l->head], n);
+        l->head = (l->head + n) % HOST_TXQ_SIZE;
+        l->count -= n;
+        done -= n;
+    }
+}
+
+/* ===================================================================
+ * host_line_frame
+ * フレーム境界の記録 (tetris_main.c の present_frame から呼ばれる)
+ *
+ * 概要:
+ * フレームの最後のバイトを送り終わる時刻を境界の時刻とする。
+ * それより前に受け取った入力があれば、その受信からの時間を
+ * 入力→画面反映の遅延として集計する。
+ * =================================================================== */
+void host_line_frame(int ch)
+{
+    HostLine *l = &host_line[ch];
+    long long now = host_now_ns();
+    long long end = (l->busy_until > now) ? l->busy_until : now;
+
+    l->frames++;
+    if (l->count > l->backlog_max) l->backlog_max = l->count;
+    if (l->in_ns) {
+        long long lat = end - l->in_ns;
+        l->lat_sum += lat;
+        if (lat > l->lat_max) l->lat_max = lat;
+        l->lat_count++;
+        l->in_ns = 0;
+    }
+    if (host_line_log != NULL) {
+        fprintf(host_line_log, "%d %lld %lu %d\n", ch, (end - host_start_ns) / 1000,
+                l->frame_bytes, l->count);
+    }
+    l->frame_bytes = 0;
+}
+
+/* ===================================================================
+ * host_line_report
+ * 回線モデルの集計を表示し、送信キューに残ったバイトを書き出す
+ * =================================================================== */
+static void host_line_report(void)
+{
+    int ch;
+
+    for (ch = 0; ch < NUMPORT; ch++) {
+        HostLine *l = &host_line[ch];
+        if (l->count > 0) {
+            host_line_drain(ch, l->busy_until);
+        }
+        if (l->frames == 0) continue;
+        fprintf(stderr, "\r\nPort%d: ", ch);
+        if (host_char_ns) fprintf(stderr, "%ld %s", host_baud, host_framing);
+        else fprintf(stderr, "no line model");
+        fprintf(stderr, "  frames=%lu avg %lu byte  backlog max %d byte",
+                l->frames, l->bytes / l->frames, l->backlog_max);
+        if (l->lat_count) {
+            fprintf(stderr, "  latency avg %.1fms max %.1fms (n=%lu)",
+                    l->lat_sum / 1e6 / l->lat_count, l->lat_max / 1e6, l->lat_count);
+        }
+        if (l->dropped) fprintf(stderr, "  dropped %lu byte", l->dropped);
+    }
+    host_char_ns = 0; /* 以降の出力 (ストリームの掃き出し) は待たずに書く */
+}
+
+/* SIGINT/SIGTERM ハンドラ: 次のカーネル入口で終了する */
+static void host_signal(int sig)
+{
+    (void)sig;
+    host_exit_pending = 1;
+}
+
+/* ===================================================================
+ * host_init
+ * ポートと端末の準備 (init_kernel から呼ばれる)
+ *
+ * 概要:
+ * Port0 は標準入出力とし、端末を raw モードにする (Ctrl-C の SIGINT は残す)。
+ * Port1 以降はポート毎に擬似端末を作り、スレーブ側の名前を表示する
+ * (例: screen /dev/pts/3 で Player 2 として接続する)。
+ * 環境変数 MTK_HOST_SKIPMT_US で skipmt の待ち時間を変更できる
+ * (0 にすると待たずに切り替える. 負荷試験用)。
+ * 環境変数 MTK_HOST_NO_PTY を指定すると、Port1 以降は擬似端末の代わりに
+ * /dev/null につなぐ (入力なし. ボット同士を無人で動かす負荷試験用)。
+ * =================================================================== */
+void host_init(void)
+{
+    struct termios tio;
+    const char *env;
+    int ch, master;
+
+    env = getenv("MTK_HOST_SKIPMT_US");
+    if (env != NULL) host_skipmt_usec = atol(env);
+    host_line_setup();
+    host_start_ns = host_now_ns();
+
+    /* ---------------------------------------------------------------
+     * 1. Port1 以降: 擬似端末 (MTK_HOST_NO_PTY なら /dev/null)
+     * --------------------------------------------------------------- */
+    for (ch = 1; ch < NUMPORT; ch++) {
+        if (getenv("MTK_HOST_NO_PTY") != NULL) {
+            host_in_fd[ch] = open("/dev/null", O_RDONLY);
+            host_out_fd[ch] = open("/dev/null", O_WRONLY);
+            host_pty_slave[ch] = -1;
+            if (host_in_fd[ch] < 0 || host_out_fd[ch] < 0) {
+                perror("/dev/null");
+                exit(1);
+            }
+            fprintf(stderr, "Port%d: /dev/null\n", ch);
+            continue;
+        }
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+            perror("posix_openpt");
+            exit(1);
+        }
+        host_pty_slave[ch] = open(ptsname(master), O_RDWR | O_NOCTTY);
+        if (host_pty_slave[ch] >= 0 && tcgetattr(host_pty_slave[ch], &tio) == 0) {
+            cfmakeraw(&tio);
+            tcsetattr(host_pty_slave[ch], TCSANOW, &tio);
+        }
+        fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+        host_in_fd[ch] = host_out_fd[ch] = master;
+        fprintf(stderr, "Port%d: %s\n", ch, ptsname(master));
+    }
+
+    /* ---------------------------------------------------------------
+     * 2. Port0: 標準入出力
+     * --------------------------------------------------------------- */
+    host_in_fd[0] = STDIN_FILENO;
+    host_out_fd[0] = STDOUT_FILENO;
+    if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &host_saved_tio) == 0) {
+        host_tio_saved = 1;
+        tio = host_saved_tio;
+        cfmakeraw(&tio);
+        tio.c_lflag |= ISIG;
+        tcsetattr(STDIN_FILENO, TCSANOW, &tio);
+    }
+    atexit(host_exit);
+    signal(SIGINT, host_signal);
+    signal(SIGTERM, host_signal);
+}
+
+/* ===================================================================
+ * host_init_context
+ * タスクのコンテキスト作成 (init_stack から呼ばれる)
+ *
+ * 引数:
+ * id: タスクID, stack/size: 使用するスタック領域, func: タスク関数
+ * 戻り値:
+ * TCB の stack_ptr に保存するコンテキストへのポインタ
+ * =================================================================== */
+void *host_init_context(TASK_ID_TYPE id, void *stack, unsigned long size, void (*func)())
+{
+    ucontext_t *uc = &host_ctx[id];
+
+    getcontext(uc);
+    uc->uc_stack.ss_sp = stack;
+    uc->uc_stack.ss_size = size;
+    uc->uc_link = NULL;
+    sigemptyset(&uc->uc_sigmask);
+    makecontext(uc, (void (*)(void))func, 0);
+    return uc;
+}
+
+/* ===================================================================
+ * first_task
+ * 最初のタスクを起動する (戻ってこない)
+ * =================================================================== */
+void first_task(void)
+{
+    setcontext((ucontext_t *)task_tab[curr_task].stack_ptr);
+}
+
+/* ===================================================================
+ * swtch
+ * タスクの切り替え (curr_task -> next_task)
+ * =================================================================== */
+void swtch(void)
+{
+    TASK_ID_TYPE prev = curr_task;
+
+    curr_task = next_task;
+    if (prev == curr_task) return;
+    swapcontext((ucontext_t *)task_tab[prev].stack_ptr,
+                (ucontext_t *)task_tab[curr_task].stack_ptr);
+}
+
+/* ===================================================================
+ * hard_clock
+ * タイマ割り込み処理 (ティック更新とラウンドロビン切り替え)
+ *
+ * 引数:
+ * from_irq: タイマ割り込みのとき 1, skipmt のとき 0
+ * =================================================================== */
+static void hard_clock(int from_irq)
+{
+    hard_clock_body(from_irq);
+    swtch();
+}
+
+#ifndef MTK_TICKLESS
+/* タイマを開始してから TCN1 が TCMP1 (MTK_TIMER_PERIODIC) に一致した回数 */
+static unsigned long host_timer_periods(void)
+{
+    return (unsigned long)((host_now_ns() - host_timer_base_ns) /
+                           (MTK_TIMER_PERIODIC * (HOST_NS_PER_SEC / MTK_TIMER_HZ)));
+}
+#endif
+
+/* 保留中のタイマ割り込み・終了要求を処理する (カーネル入口で呼ぶ) */
+/* exit 中のストリーム掃き出しからも呼ばれるので、その間は何もしない */
+static void host_kernel_entry(void)
+{
+    if (host_exiting) return;
+    if (host_exit_pending) {
+        host_exiting = 1;
+        exit(0);
+    }
+    if (host_char_ns) {
+        long long now = host_now_ns();
+        int ch;
+        for (ch = 0; ch < NUMPORT; ch++) host_line_drain(ch, now);
+    }
+#ifndef MTK_TICKLESS
+    /* 周期割り込み: 処理していない一致があれば1回分を処理する */
+    if (host_timer_base_ns && host_timer_periods() > host_timer_acked) {
+        host_timer_acked++;
+        hard_clock(1);
+    }
+#else
+    if (host_clock_pending) {
+        host_clock_pending = 0;
+        hard_clock(1);
+    }
+#endif
+}
+
+#ifdef MTK_TICKLESS
+/* SIGALRM ハンドラ: 割り込み保留を立てるだけ */
+static void host_alarm(int sig)
+{
+    (void)sig;
+    host_clock_pending = 1;
+}
+#endif
+
+/* ===================================================================
+ * init_timer
+ * タイマ割り込みの開始
+ *
+ * 概要:
+ * 周期動作では、この時刻を TCN1 の 0 として MTK_TIMER_PERIODIC 毎の一致を
+ * カーネル入口で数える (実機のモニタの SET_TIMER と同じリスタートモード)。
+ * ティックレス動作では SIGALRM を使い、begin_sch が host_timer_compare で
+ * 最初の割り込み時刻を設定する。
+ * =================================================================== */
+void init_timer(void)
+{
+#ifndef MTK_TICKLESS
+    host_timer_acked = 0;
+    host_timer_base_ns = host_now_ns();
+#else
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = host_alarm;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
+#endif
+}
+
+/* ===================================================================
+ * host_timer_count / host_timer_compare
+ * TCN1 (MTK_TIMER_HZ で進む 16bit カウンタ) と TCMP1 の代わり
+ *
+ * 概要:
+ * カウンタは経過時間 (CLOCK_MONOTONIC) から求める。
+ * 周期動作では最後に処理した一致からのカウント数を返す (割り込みの処理は
+ * 次のカーネル入口まで遅れるので、処理待ちの周期の分も含めて返し、
+ * カーネルの TIMER_PENDING は 0 とする)。
+ * ティックレス動作ではフリーランの値を返し、一致時刻を設定すると、
+ * そこまでの時間で1回限りの SIGALRM を予約する
+ * (割り込みは実機と同様に次のカーネル入口で処理される)。
+ * =================================================================== */
+unsigned short host_timer_count(void)
+{
+#ifndef MTK_TICKLESS
+    long long counts = (host_now_ns() - host_timer_base_ns) / (HOST_NS_PER_SEC / MTK_TIMER_HZ);
+    return (unsigned short)(counts - (long long)host_timer_acked * MTK_TIMER_PERIODIC);
+#else
+    return (unsigned short)((host_now_ns() - host_start_ns) / (HOST_NS_PER_SEC / MTK_TIMER_HZ));
+#endif
+}
+
+#ifdef MTK_TICKLESS
+void host_timer_compare(unsigned short cmp)
+{
+    struct itimerval it;
+    long counts = (unsigned short)(cmp - host_timer_count());
+    long long ns = (long long)(counts ? counts : 0x10000) * (HOST_NS_PER_SEC / MTK_TIMER_HZ);
+
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 0;
+    it.it_value.tv_sec = ns / HOST_NS_PER_SEC;
+    it.it_value.tv_usec = (ns % HOST_NS_PER_SEC) / 1000;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/* ===================================================================
+ * host_idle
+ * 実行可能タスクがないとき (sched のアイドル待ち) に次の割り込みまで止まる
+ *
+ * 概要:
+ * 実機の stop #0x2000 の代わり。sched が TCMP1 を設定した後に呼ばれ、
+ * SIGALRM が届くまで sigsuspend で待つ。届いた割り込みは待ちを解くのに
+ * 使ったものとして保留を消す (実機でもアイドル中の hard_clock は何もしない)。
+ * =================================================================== */
+void host_idle(void)
+{
+    sigset_t mask, old;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    sigprocmask(SIG_BLOCK, &mask, &old);
+    while (!host_clock_pending && !host_exit_pending) sigsuspend(&old);
+    host_clock_pending = 0;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (host_exit_pending) {
+        host_exiting = 1;
+        exit(0);
+    }
+}
+#endif
+
+/* ===================================================================
+ * skipmt
+ * 強制タスク切り替え
+ *
+ * 概要:
+ * 実機のモニタと同様に hard_clock 相当の処理を行う (tick も進む)。
+ * 実機のトラップ処理の時間の代わりに host_skipmt_usec だけ待つ。
+ * =================================================================== */
+void skipmt(void)
+{
+    host_kernel_entry();
+    if (host_skipmt_usec > 0) {
+        struct timespec ts;
+        ts.tv_sec = host_skipmt_usec / 1000000;
+        ts.tv_nsec = (host_skipmt_usec % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+    hard_clock(0);
+}
+
+/* ===================================================================
+ * P / V
+ * セマフォ操作 (実機では TRAP #1 経由)
+ * =================================================================== */
+void P(int sem_id)
+{
+    host_kernel_entry();
+    p_body(sem_id);
+}
+
+void V(int sem_id)
+{
+    host_kernel_entry();
+    v_body(sem_id);
+}
+
+/* 時間待ち (実機では TRAP #1 経由) */
+void sleep_trap(unsigned long t)
+{
+    host_kernel_entry();
+    sleep_until_body(t);
+}
+
+/* ソフトウェアタイマの登録・取り消し (実機では TRAP #1 経由) */
+void timer_start_trap(MtkTimer *t)
+{
+    host_kernel_entry();
+    timer_start_body(t);
+}
+
+void timer_stop_trap(MtkTimer *t)
+{
+    host_kernel_entry();
+    timer_stop_body(t);
+}
+
+/* ===================================================================
+ * inbyte(ch)
+ * ポートからの1文字入力 (ノンブロッキング)
+ *
+ * 戻り値:
+ * 0〜255: 受信した文字コード, -1: データなし
+ * Ctrl-C を受け取った場合はプログラムを終了する。
+ * =================================================================== */
+int inbyte(int ch)
+{
+    struct pollfd pfd;
+    unsigned char c;
+
+    host_kernel_entry();
+
+    pfd.fd = host_in_fd[ch];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN)) return -1;
+    if (read(host_in_fd[ch], &c, 1) != 1) return -1;
+    if (c == HOST_KEY_EXIT) {
+        host_exiting = 1;
+        exit(0);
+    }
+    if (host_line[ch].in_ns == 0) host_line[ch].in_ns = host_now_ns();
+    return c;
+}
+
+/* ===================================================================
+ * outbyte(ch, c)
+ * ポートへの1文字出力
+ *
+ * 概要:
+ * Port1 以降の相手が接続していない (読まない) 場合は、擬似端末が一杯に
+ * なった後のバイトを捨てる (実機の UART と同様に、受け手がいなくても止まらない)。
+ * 回線モデルが有効な場合は送信キューに入れる。キューが一杯なら
+ * 先頭の1文字を送り終わるまで待つ (待つ間もタイマ割り込みで切り替わる)。
+ * 終了処理中 (ストリームの掃き出し) は回線モデルを通さずにすぐ書く。
+ * =================================================================== */
+void outbyte(int ch, unsigned char c)
+{
+    HostLine *l = &host_line[ch];
+    long long now;
+
+    host_kernel_entry();
+    l->bytes++;
+    l->frame_bytes++;
+    if (!host_char_ns || host_exiting) {
+        host_write_fd(ch, &c, 1);
+        return;
+    }
+
+    now = host_now_ns();
+    host_line_drain(ch, now);
+    while (l->count >= HOST_TXQ_SIZE) {
+        long long wait = l->busy_until - (l->count - 1) * host_char_ns - now;
+        if (wait > 0) {
+            struct timespec ts;
+            ts.tv_sec = wait / HOST_NS_PER_SEC;
+            ts.tv_nsec = wait % HOST_NS_PER_SEC;
+            nanosleep(&ts, NULL);
+        }
+        host_kernel_entry();
+        now = host_now_ns();
+        host_line_drain(ch, now);
+    }
+
+    l->q[(l->head + l->count) % HOST_TXQ_SIZE] = c;
+    l->count++;
+    l->busy_until = ((l->busy_until > now) ? l->busy_until : now) + host_char_ns;
+}
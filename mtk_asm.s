@@ -29,7 +29,7 @@ first_task:
      * --------------------------------------------------------------- */
     lea.l    task_tab, %a0
     move.l   curr_task, %d0
-    mulu.w   #20, %d0        /* sizeof(TCB)=20バイト */
+    mulu.w   #24, %d0        /* sizeof(TCB)=24バイト */
     adda.l   %d0, %a0
 
     /* ---------------------------------------------------------------
@@ -67,11 +67,15 @@ first_task:
  *
  * 概要:
  * P/Vシステムコールの分岐処理を行う。
- * 引数 %d0=0 -> P命令, %d0=1 -> V命令
+ * 引数 %d0=0 -> P命令, %d0=1 -> V命令, %d0=2 -> 時間待ち (%d1=起床時刻)
+ *      %d0=3 -> タイマ登録, %d0=4 -> タイマ取り消し (%d1=MtkTimer のアドレス)
  * =================================================================== */
     .global pv_handler
     .extern p_body
     .extern v_body
+    .extern sleep_until_body
+    .extern timer_start_body
+    .extern timer_stop_body
     
 pv_handler:
     /* ---------------------------------------------------------------
@@ -96,6 +100,12 @@ pv_handler:
     beq     to_p_body    /* %d0=0なら to_p_bodyへ */
     cmp.i   #1, %d0
     beq     to_v_body    /* %d0=1なら to_v_bodyへ */
+    cmp.i   #2, %d0
+    beq     to_sleep_body /* %d0=2なら to_sleep_bodyへ */
+    cmp.i   #3, %d0
+    beq     to_timer_start /* %d0=3なら to_timer_startへ */
+    cmp.i   #4, %d0
+    beq     to_timer_stop /* %d0=4なら to_timer_stopへ */
 
     /* 想定外のシステムコール番号の場合は何もせず終了 */
     bra     pv_handler_finish
@@ -111,6 +121,24 @@ to_v_body:
     jsr     v_body        /* C言語の v_body を呼ぶ */
     move.l  (%SP)+, %d1   /* 積んだ引数を破棄してSPを戻す */
     bra     pv_handler_finish
+
+to_sleep_body:
+    move.l  %d1, -(%SP)   /* 引数(起床時刻)をスタックに積む */
+    jsr     sleep_until_body /* C言語の sleep_until_body を呼ぶ */
+    move.l  (%SP)+, %d1   /* 積んだ引数を破棄してSPを戻す */
+    bra     pv_handler_finish
+
+to_timer_start:
+    move.l  %d1, -(%SP)   /* 引数(タイマ)をスタックに積む */
+    jsr     timer_start_body /* C言語の timer_start_body を呼ぶ */
+    move.l  (%SP)+, %d1   /* 積んだ引数を破棄してSPを戻す */
+    bra     pv_handler_finish
+
+to_timer_stop:
+    move.l  %d1, -(%SP)   /* 引数(タイマ)をスタックに積む */
+    jsr     timer_stop_body /* C言語の timer_stop_body を呼ぶ */
+    move.l  (%SP)+, %d1   /* 積んだ引数を破棄してSPを戻す */
+    bra     pv_handler_finish
     
 pv_handler_finish:
     /* ---------------------------------------------------------------
@@ -201,6 +229,51 @@ V:
     rts
 
 
+/* ===================================================================
+ * sleep_trap
+ * 時間待ちシステムコールの入り口 (mtk_c.c の sleep_until から呼ばれる)
+ * 概要:
+ * 引数 (起床時刻) を取得し、TRAP #1 (機能番号2) を発行する
+ * =================================================================== */
+    .global sleep_trap
+sleep_trap:
+    movem.l %d0-%d1/%a0, -(%sp)
+    move.l  #2, %d0
+    move.l  %SP, %a0
+    adda.l  #16, %a0
+    move.l  (%a0), %d1    /* %d1 に起床時刻をセット */
+    TRAP    #1
+    movem.l (%SP)+, %d0-%d1/%a0
+    rts
+
+
+/* ===================================================================
+ * timer_start_trap / timer_stop_trap
+ * ソフトウェアタイマの登録・取り消しシステムコールの入り口
+ * (mtk_c.c の mtk_timer_start / mtk_timer_stop から呼ばれる)
+ * 概要:
+ * 引数 (MtkTimer のアドレス) を取得し、TRAP #1 (機能番号3, 4) を発行する
+ * =================================================================== */
+    .global timer_start_trap
+    .global timer_stop_trap
+timer_start_trap:
+    movem.l %d0-%d1/%a0, -(%sp)
+    move.l  #3, %d0
+    bra     timer_trap_common
+
+timer_stop_trap:
+    movem.l %d0-%d1/%a0, -(%sp)
+    move.l  #4, %d0
+
+timer_trap_common:
+    move.l  %SP, %a0
+    adda.l  #16, %a0
+    move.l  (%a0), %d1    /* %d1 にタイマのアドレスをセット */
+    TRAP    #1
+    movem.l (%SP)+, %d0-%d1/%a0
+    rts
+
+
 /* ===================================================================
  * swtch
  * タスクの切り替え (コンテキストスイッチ)
@@ -233,7 +306,7 @@ swtch:
     /* A0 = &task_tab[curr_task] */
     lea.l    task_tab, %a0
     move.l   curr_task, %d0
-    mulu.w   #20, %d0
+    mulu.w   #24, %d0
     adda.l   %d0, %a0
     
     /* 現在のSP(SSP)を TCB->stack_ptr (offset 4) に書き込む */
@@ -254,7 +327,7 @@ swtch:
     /* A0 = &task_tab[curr_task] (新しいタスク) */
     lea.l    task_tab, %a0
     /* %d0にはすでにnext_taskが入っている */
-    mulu.w   #20, %d0
+    mulu.w   #24, %d0
     adda.l   %d0, %a0
 
     /* TCB->stack_ptr から SP(SSP) を復元 */
@@ -285,6 +358,9 @@ swtch:
  * 割り込み前の処理を破壊しないよう全レジスタを退避し、
  * C言語で書かれた本体処理 (hard_clock_body) を呼び出す。
  * その後、タスク切り替え (swtch) を行い、復帰する。
+ * モニタはタイマ割り込みと skipmt (TRAP #0) の両方からここを呼ぶ。
+ * 入口の SR の割り込みレベルは、タイマ割り込みからならその割り込みレベル、
+ * skipmt (タスクからの TRAP) なら 0 なので、それを hard_clock_body に渡す。
  * =================================================================== */
     .global hard_clock
     .extern hard_clock_body
@@ -306,8 +382,13 @@ hard_clock:
     /* ---------------------------------------------------------------
      * 3. 割り込み処理本体の呼び出し
      * Readyキューへの追加やスケジューリングを行う
+     * 引数: 入口で積んだ SR (レジスタ 60 バイトの上) の割り込みレベル
      * --------------------------------------------------------------- */
+    move.w  60(%SP), %d0
+    andi.l  #0x0700, %d0  /* 0 以外ならタイマ割り込みから */
+    move.l  %d0, -(%SP)
     jsr     hard_clock_body
+    move.l  (%SP)+, %d0   /* 積んだ引数を破棄してSPを戻す */
     
     /* ---------------------------------------------------------------
      * 4. タスク切り替え
@@ -333,6 +414,9 @@ hard_clock:
  *
  * 概要:
  * モニタのシステムコールを利用して、タイマ割り込みを設定する。
+ * (周期動作ではこの設定 (リスタートモード, 500 カウント毎) のまま使う。
+ *  MTK_TICKLESS 時は、この後 begin_sch が TCN1 をフリーランにして
+ *  TCMP1 を次の起床時刻・タイムスライスの終わりに設定し直す)
  * =================================================================== */
     .global init_timer
 
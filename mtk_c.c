@@ -13,6 +13,69 @@ extern void hard_clock();
 extern void swtch();
 extern void first_task();
 extern void init_timer();
+#ifdef MTK_HOST
+extern void host_init(void);
+extern void *host_init_context(TASK_ID_TYPE id, void *stack, unsigned long size, void (*func)());
+#endif
+extern void skipmt();
+extern void sleep_trap(unsigned long t);
+extern void timer_start_trap(MtkTimer *t);
+extern void timer_stop_trap(MtkTimer *t);
+
+/* -------------------------------------------------------------------
+ * タイマ1 (TCN1/TCMP1) の操作
+ * 周期動作では、モニタの SET_TIMER の設定 (リスタートモード. TCMP1 との一致で
+ * 割り込み、カウンタは 0 に戻る) をそのまま使う。
+ * ティックレス動作では TCN1 をフリーランモードの 16bit カウンタとして使い、
+ * 次に割り込ませる時刻を TCMP1 に設定する。
+ * (割り込みの受け付けと TSTAT1 のクリアはどちらもモニタが行い、hard_clock を呼ぶ)
+ * ------------------------------------------------------------------- */
+#ifdef MTK_HOST
+extern unsigned short host_timer_count(void);
+extern void host_timer_compare(unsigned short cmp);
+extern void host_idle(void);
+#define TIMER_COUNT()      host_timer_count()
+#define TIMER_PENDING()    0 /* ホストは処理待ちの周期も TCN1 の値に含めて返す */
+#define TIMER_COMPARE(cmp) host_timer_compare(cmp)
+#define TIMER_FREE_RUN()
+#define IDLE_WAIT()        host_idle()
+#else
+#define TCTL1_REG  (*(volatile unsigned short *)0xFFF600) /* コントロールレジスタ */
+#define TCMP1_REG  (*(volatile unsigned short *)0xFFF604) /* コンペアレジスタ */
+#define TCN1_REG   (*(volatile unsigned short *)0xFFF608) /* カウンタレジスタ */
+#define TSTAT1_REG (*(volatile unsigned short *)0xFFF60A) /* ステータスレジスタ */
+#define TCTL1_FRR  0x0100  /* フリーラン (一致してもカウンタを 0 に戻さない) */
+#define TSTAT1_COMP 0x0001 /* 一致した (モニタの割り込み処理がクリアするまで 1) */
+#define TIMER_COUNT()      TCN1_REG
+#define TIMER_PENDING()    (TSTAT1_REG & TSTAT1_COMP)
+#define TIMER_COMPARE(cmp) (TCMP1_REG = (cmp))
+#define TIMER_FREE_RUN()   (TCTL1_REG |= TCTL1_FRR)
+/* 割り込みレベル 0 で次の割り込みまで止まり、戻ったら再び割り込み禁止にする */
+#define IDLE_WAIT()        __asm__ __volatile__ ("stop #0x2000\n\tmove.w #0x2700, %%sr" ::: "memory")
+#endif
+#ifdef MTK_TICKLESS
+/* 前回読んだ値 last から now までのカウント数 (1周未満の折り返しを考慮) */
+#define TIMER_ELAPSED(last, now) ((unsigned short)((now) - (last)))
+#define TIMER_COUNTS_PER_TICK (MTK_TIMER_HZ / MTK_TICK_HZ)
+#define TIMER_MAX_WAIT  0x4000 /* 1回に待つ最大カウント (カウンタの1周より十分短くする) */
+#define TIMER_MIN_WAIT  2      /* 一致時刻を書き込む時点で過ぎないための余裕 */
+#endif
+
+void timer_link(MtkTimer *t);
+void timer_wheel_advance(void);
+#ifndef MTK_TICKLESS
+void clock_period(void);
+#else
+void clock_update(void);
+void timer_program(void);
+void add_sleeping(TASK_ID_TYPE id);
+void wake_sleepers(void);
+int timer_next_expire(unsigned long *t);
+#endif
+
+/* キュー操作 (定義は後方) */
+void addq(TASK_ID_TYPE *queue, TASK_ID_TYPE new_task);
+TASK_ID_TYPE removeq(TASK_ID_TYPE *queue);
 
 /* ===================================================================
  * 大域変数の実体定義
@@ -38,9 +101,31 @@ TASK_ID_TYPE curr_task;  /* 現在実行中のタスクID */
 TASK_ID_TYPE new_task;   /* 新規作成中のタスクID */
 TASK_ID_TYPE next_task;  /* 次に実行するタスクID */
 TASK_ID_TYPE ready;      /* 実行待ちタスクキューの先頭ID */
+TASK_ID_TYPE sleeping;   /* 時間待ちタスクキューの先頭ID (起床時刻の早い順. ティックレス動作) */
 
 volatile unsigned long tick = 0; /* タイマティックカウンタ */
 
+/* -------------------------------------------------------------------
+ * ソフトウェアタイマ (満了 tick の下位ビットでスロットに振り分ける)
+ * ------------------------------------------------------------------- */
+#define WHEEL_SLOTS 16                /* スロット数 (2のべき乗) */
+#define WHEEL_MASK  (WHEEL_SLOTS - 1)
+MtkTimer *timer_wheel[WHEEL_SLOTS];   /* スロット毎のタイマのリスト */
+unsigned long wheel_tick;             /* 満了処理を済ませた tick */
+int timer_active;                     /* 登録中のタイマの数 */
+
+/* -------------------------------------------------------------------
+ * 時刻管理 (TCN1 の進みを積算する. mtk_now_cycles が読む)
+ * ------------------------------------------------------------------- */
+volatile unsigned long clock_counts; /* 積算済みの TCN1 の総カウント数 */
+volatile unsigned long clock_seq;    /* 積算の度に進める (読み取り側の一貫性確認) */
+#ifdef MTK_TICKLESS
+volatile unsigned short clock_last;  /* 前回読んだ TCN1 の値 */
+unsigned long clock_frac;   /* tick に満たない端数のカウント */
+unsigned long slice_end;    /* 実行中のタスクのタイムスライスが終わる tick */
+volatile int kernel_idle;   /* sched のアイドル待ち中 (割り込みを許可して止まっている) は 1 */
+#endif
+
 /* -------------------------------------------------------------------
  * 2ポート入出力用ファイルポインタ
  * ------------------------------------------------------------------- */
@@ -76,6 +161,10 @@ void init_kernel(void)
      * 最初は誰も待機していないのでNULLTASKIDとする
      * --------------------------------------------------------------- */
     ready = NULLTASKID;
+    sleeping = NULLTASKID;
+    for (i = 0; i < WHEEL_SLOTS; i++) timer_wheel[i] = NULL;
+    wheel_tick = tick;
+    timer_active = 0;
 
     /* ---------------------------------------------------------------
      * 3. セマフォの初期化
@@ -91,8 +180,13 @@ void init_kernel(void)
      * 4. 割り込みベクタの設定
      * TRAP #1 (システムコール) ベクタに pv_handler を登録する
      * ベクタ番号 33 -> アドレス 33*4 = 132 (0x84)
+     * (ホスト実行時はベクタの代わりに端末・ポートを準備する)
      * --------------------------------------------------------------- */
+#ifdef MTK_HOST
+    host_init();
+#else
     *(void (**)())0x84 = pv_handler;
+#endif
 }
 
 /* ===================================================================
@@ -106,6 +200,10 @@ void init_kernel(void)
  * =================================================================== */
 void *init_stack(TASK_ID_TYPE id)
 {
+#ifdef MTK_HOST
+    /* ホスト実行時: スタック全体 (ユーザ+システム) を使うコンテキストを作る */
+    return host_init_context(id, &stacks[id - 1], sizeof(STACK_TYPE), task_tab[id].task_addr);
+#else
     /* ---------------------------------------------------------------
      * 1. 作業用ポインタの準備
      * スーパバイザスタックの「底（上限アドレス）」を取得する
@@ -157,6 +255,7 @@ void *init_stack(TASK_ID_TYPE id)
 
     /* 作成したスタックの先頭アドレス(SSP)を返す */
     return (void *)sp_l;
+#endif
 }
 
 /* ===================================================================
@@ -226,6 +325,14 @@ void begin_sch()
     
     /* タイマ割り込みを開始 */
     init_timer();
+#ifdef MTK_TICKLESS
+    /* TCN1 をフリーランにし、最初の割り込み時刻を設定する */
+    TIMER_FREE_RUN();
+    clock_last = TIMER_COUNT();
+    clock_frac = 0;
+    slice_end = tick + MTK_SLICE_TICKS;
+    timer_program();
+#endif
     
     /* 最初のタスクを起動 (ここから戻ってくることはない) */
     first_task();
@@ -284,6 +391,390 @@ TASK_ID_TYPE removeq(TASK_ID_TYPE *queue)
     }
 }
 
+#ifndef MTK_TICKLESS
+/* ===================================================================
+ * clock_period
+ * 周期割り込み1回分 (MTK_TIMER_PERIODIC カウント) を積算する (周期動作)
+ *
+ * 概要:
+ * タイマ割り込みからの hard_clock_body だけが呼ぶ (skipmt からは呼ばない)。
+ * リスタートモードの TCN1 は一致で 0 に戻るので、その分を clock_counts に足す。
+ * =================================================================== */
+void clock_period(void)
+{
+    clock_seq++;
+    clock_counts += MTK_TIMER_PERIODIC;
+    clock_seq++;
+}
+#else
+/* ===================================================================
+ * clock_update
+ * TCN1 の進みを積算する (割り込み禁止中に呼ぶ. ティックレス動作)
+ *
+ * 概要:
+ * 前回読んだ値からの差 (16bit の周回を考慮) を clock_counts と端数に足し、
+ * TIMER_COUNTS_PER_TICK カウント毎に tick を1進める。
+ * カウンタが1周する前に呼ばれること (timer_program が TIMER_MAX_WAIT 以内に
+ * 割り込ませるので、割り込み禁止が長く続かない限り満たされる)。
+ * =================================================================== */
+void clock_update(void)
+{
+    unsigned short now = TIMER_COUNT();
+    unsigned long delta = TIMER_ELAPSED(clock_last, now);
+
+    clock_seq++;
+    clock_counts += delta;
+    clock_last = now;
+    clock_seq++;
+    clock_frac += delta;
+    tick += clock_frac / TIMER_COUNTS_PER_TICK;
+    clock_frac %= TIMER_COUNTS_PER_TICK;
+}
+#endif
+
+/* ===================================================================
+ * mtk_now_cycles
+ * 高分解能の現在時刻 (TCN1 のカウント数. MTK_TIMER_HZ で進む)
+ *
+ * 概要:
+ * 積算済みのカウント数に、今の TCN1 までの進みを足す。
+ * 周期動作では TCN1 の値 (最後の一致からのカウント数) をそのまま足し、
+ * 一致したのに割り込みがまだ処理されていない (割り込み禁止中など) 場合は
+ * さらに1周期分を足す (TSTAT1 を TCN1 の前後で読み、変わっていたら読み直す)。
+ * ティックレス動作では前回の積算から今の TCN1 までの差を足す。
+ * 割り込み禁止にせずに読むため、途中で積算が走った場合
+ * (clock_seq が変わった場合) は読み直す。割り込み処理中からも呼べる。
+ * 値は 32bit で折り返すので、差を取って使うこと。
+ * =================================================================== */
+unsigned long mtk_now_cycles(void)
+{
+    unsigned long seq, base;
+    unsigned short now;
+#ifndef MTK_TICKLESS
+    unsigned short pending;
+
+    do {
+        seq = clock_seq;
+        base = clock_counts;
+        pending = TIMER_PENDING();
+        now = TIMER_COUNT();
+    } while (seq != clock_seq || pending != TIMER_PENDING());
+    if (pending) base += MTK_TIMER_PERIODIC;
+    return base + now;
+#else
+    unsigned short last;
+
+    do {
+        seq = clock_seq;
+        base = clock_counts;
+        last = clock_last;
+        now = TIMER_COUNT();
+    } while (seq != clock_seq);
+    return base + TIMER_ELAPSED(last, now);
+#endif
+}
+
+#ifdef MTK_PROFILE
+/* ===================================================================
+ * mtk_prof_add / mtk_prof_report
+ * 区間計測 (MTK_PROFILE_SCOPE) の集計と表示
+ *
+ * 概要:
+ * 計測点は最初に記録したときに一覧へつなぐ。表示は µs 単位
+ * (分解能は TCN1 の1カウント. 短い区間は平均で見る)。
+ * 区間の途中で他のタスクに切り替わった時間も含む。
+ * 集計は割り込み禁止にせずに行うので、同じ計測点を複数のタスクが
+ * 同時に通ると1件分が失われることがある。
+ * =================================================================== */
+#define US_PER_COUNT (1000000 / MTK_TIMER_HZ) /* TCN1 の1カウントの µs */
+
+MtkProf *mtk_prof_list; /* 記録のある計測点の一覧 */
+
+void mtk_prof_add(MtkProf *p, unsigned long cycles)
+{
+    if (p->count == 0) {
+        p->next = mtk_prof_list;
+        mtk_prof_list = p;
+    }
+    p->count++;
+    p->total += cycles;
+    if (cycles > p->max) p->max = cycles;
+}
+
+void mtk_prof_report(FILE *fp)
+{
+    MtkProf *p;
+
+    fprintf(fp, "\nProfile [us]: %-12s %8s %8s %8s\n", "scope", "count", "avg", "max");
+    for (p = mtk_prof_list; p != NULL; p = p->next) {
+        /* 平均は1カウント未満の端数も µs に換算する */
+        unsigned long avg = p->total / p->count * US_PER_COUNT
+                          + p->total % p->count * US_PER_COUNT / p->count;
+        fprintf(fp, "              %-12s %8lu %8lu %8lu\n", p->name, p->count, avg,
+                p->max * US_PER_COUNT);
+    }
+}
+#endif
+
+/* 満了時刻 (t->expire) のスロットの先頭につなぐ */
+void timer_link(MtkTimer *t)
+{
+    MtkTimer **slot = &timer_wheel[t->expire & WHEEL_MASK];
+
+    t->next = *slot;
+    *slot = t;
+    t->active = 1;
+    timer_active++;
+}
+
+/* ===================================================================
+ * timer_start_body / timer_stop_body
+ * ソフトウェアタイマの登録・取り消し (割り込み禁止中に呼ぶ)
+ *
+ * 概要:
+ * 登録では t->expire (mtk_timer_start の delay) を現在の tick からの
+ * 満了時刻に直し、その下位ビットのスロットの先頭につなぐ。
+ * 処理済みの tick 以前になる場合 (delay 0) は次の tick で満了させる。
+ * タスクからは mtk_timer_start / mtk_timer_stop (TRAP #1) 経由で、
+ * タイマのコールバックからは直接呼ぶ。
+ * =================================================================== */
+void timer_start_body(MtkTimer *t)
+{
+#ifdef MTK_TICKLESS
+    /* 実行中 (begin_sch 以降) なら tick を今の時刻まで進めておく */
+    if (curr_task != NULLTASKID) clock_update();
+#endif
+    timer_stop_body(t);
+    t->expire += tick;
+    if ((long)(t->expire - wheel_tick) <= 0) t->expire = wheel_tick + 1;
+    timer_link(t);
+#ifdef MTK_TICKLESS
+    /* 満了時刻に割り込むよう設定し直す */
+    if (curr_task != NULLTASKID) timer_program();
+#endif
+}
+
+void timer_stop_body(MtkTimer *t)
+{
+    MtkTimer **p;
+
+    if (!t->active) return;
+    for (p = &timer_wheel[t->expire & WHEEL_MASK]; *p != NULL; p = &(*p)->next) {
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+    t->active = 0;
+    timer_active--;
+}
+
+/* ===================================================================
+ * mtk_timer_start / mtk_timer_stop
+ * ソフトウェアタイマの登録・取り消し (タスクから呼ぶ)
+ *
+ * 概要:
+ * タイマの内容を設定してから、TRAP #1 (機能番号 3, 4) で
+ * 割り込み禁止にして timer_start_body / timer_stop_body を呼ぶ。
+ * begin_sch の前 (main の中) からも呼べる。
+ * =================================================================== */
+void mtk_timer_start(MtkTimer *t, unsigned long delay, unsigned long period,
+                     void (*func)(void *arg), void *arg)
+{
+    timer_stop_trap(t);
+    t->func = func;
+    t->arg = arg;
+    t->period = period;
+    t->expire = delay;
+    timer_start_trap(t);
+}
+
+void mtk_timer_stop(MtkTimer *t)
+{
+    timer_stop_trap(t);
+}
+
+/* ===================================================================
+ * timer_wheel_advance
+ * 満了したソフトウェアタイマのコールバックを呼ぶ (hard_clock_body から)
+ *
+ * 概要:
+ * 処理済みの tick から現在の tick まで1つずつ進め、その tick のスロットで
+ * 満了時刻が一致するタイマを外してコールバックを呼ぶ (他のスロットは見ない)。
+ * 周期タイマはコールバックの前に次の満了時刻で登録し直す。
+ * コールバックがタイマを操作してもよいように、1つ呼ぶ毎にスロットの
+ * 先頭から探し直す。
+ * =================================================================== */
+void timer_wheel_advance(void)
+{
+    while (wheel_tick != tick) {
+        MtkTimer *t;
+
+        wheel_tick++;
+        for (;;) {
+            for (t = timer_wheel[wheel_tick & WHEEL_MASK]; t != NULL; t = t->next) {
+                if (t->expire == wheel_tick) break;
+            }
+            if (t == NULL) break;
+
+            timer_stop_body(t);
+            if (t->period > 0) {
+                t->expire = wheel_tick + t->period;
+                timer_link(t);
+            }
+            t->func(t->arg);
+        }
+    }
+}
+
+#ifdef MTK_TRACE
+/* ===================================================================
+ * mtk_trace / mtk_trace_dump
+ * イベントトレースの記録と書き出し
+ *
+ * 概要:
+ * 記録は MTK_TRACE_SIZE 件のリングに上書きしていき、最新の MTK_TRACE_SIZE 件が残る。
+ * カーネル内 (割り込み禁止中) からの記録どうしは重ならないが、タスクからの
+ * 記録 (MTK_TRACE_MARK) が割り込みと重なると1件が上書きされることがある。
+ * 書き出しは1件1行の文字列 ("T 時刻 イベント タスク 引数") で、書き出し中は
+ * 記録を止め (書き出し自体の P/V・切り替えで記録が流れないように)、
+ * 書き出した後は空にする。
+ * =================================================================== */
+#if (MTK_TRACE_SIZE & (MTK_TRACE_SIZE - 1)) != 0
+#error "MTK_TRACE_SIZE must be a power of 2"
+#endif
+MtkTraceRec trace_buf[MTK_TRACE_SIZE]; /* 記録のリング */
+volatile unsigned long trace_count;    /* 記録した総件数 */
+volatile int trace_paused;             /* 書き出し中は 1 */
+
+void mtk_trace(int event, int arg)
+{
+    MtkTraceRec *r;
+
+    if (trace_paused) return;
+    r = &trace_buf[trace_count++ & (MTK_TRACE_SIZE - 1)];
+    r->time = mtk_now_cycles();
+    r->event = event;
+    r->task = curr_task;
+    r->arg = arg;
+}
+
+void mtk_trace_dump(FILE *fp)
+{
+    unsigned long n, i;
+
+    trace_paused = 1;
+    n = trace_count;
+    i = (n > MTK_TRACE_SIZE) ? n - MTK_TRACE_SIZE : 0;
+    fprintf(fp, "\nMTKTRACE BEGIN hz=%lu records=%lu lost=%lu\n",
+            (unsigned long)MTK_TIMER_HZ, n - i, i);
+    for (; i < n; i++) {
+        MtkTraceRec *r = &trace_buf[i & (MTK_TRACE_SIZE - 1)];
+        fprintf(fp, "T %lu %u %u %u\n", r->time, r->event, r->task, r->arg);
+    }
+    fprintf(fp, "MTKTRACE END\n");
+    fflush(fp);
+    trace_count = 0;
+    trace_paused = 0;
+}
+
+/* swtch の直前に置き、実際に切り替わる場合だけ記録する */
+#define TRACE_SWITCH_POINT() \
+    do { if (next_task != curr_task) mtk_trace(TRACE_SWITCH, next_task); } while (0)
+#else
+#define TRACE_SWITCH_POINT()
+#endif
+
+#ifdef MTK_TICKLESS
+/* ===================================================================
+ * add_sleeping
+ * 時間待ちキューへのタスク追加
+ *
+ * 引数:
+ * id: 追加するタスクID (task_tab[id].wake_tick を設定済みであること)
+ * 概要:
+ * 起床時刻の早い順になる位置に挿入する (同じ時刻なら後ろへ)。
+ * =================================================================== */
+void add_sleeping(TASK_ID_TYPE id)
+{
+    TASK_ID_TYPE *p = &sleeping;
+
+    while (*p != NULLTASKID && task_tab[*p].wake_tick <= task_tab[id].wake_tick) {
+        p = &task_tab[*p].next;
+    }
+    task_tab[id].next = *p;
+    *p = id;
+}
+
+/* ===================================================================
+ * wake_sleepers
+ * 起床時刻になった時間待ちタスクを Readyキューへ移す
+ * =================================================================== */
+void wake_sleepers(void)
+{
+    while (sleeping != NULLTASKID && task_tab[sleeping].wake_tick <= tick) {
+        TASK_ID_TYPE id = removeq(&sleeping);
+        task_tab[id].status = READY;
+        addq(&ready, id);
+        MTK_TRACE_EVENT(TRACE_WAKEUP, id);
+    }
+}
+
+/* ===================================================================
+ * timer_next_expire
+ * 最も早いソフトウェアタイマの満了時刻を *t に求める (ティックレス動作)
+ *
+ * 戻り値:
+ * 1: 登録中のタイマあり, 0: なし
+ * =================================================================== */
+int timer_next_expire(unsigned long *t)
+{
+    MtkTimer *p;
+    int i, found = 0;
+
+    if (timer_active == 0) return 0;
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+        for (p = timer_wheel[i]; p != NULL; p = p->next) {
+            if (!found || (long)(p->expire - *t) < 0) *t = p->expire;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+/* ===================================================================
+ * timer_program
+ * 次のタイマ割り込みの時刻を TCMP1 に設定する (ティックレス動作)
+ *
+ * 概要:
+ * 実行中タスクのタイムスライスの終わり、最も早い時間待ちタスクの
+ * 起床時刻、最も早いソフトウェアタイマの満了時刻のうち最も早い時刻で
+ * 割り込ませる。その間は周期割り込みを起こさない。
+ * 設定する時点で一致時刻を過ぎそうな場合は、すぐ後に割り込ませる。
+ * =================================================================== */
+void timer_program(void)
+{
+    unsigned long deadline = slice_end;
+    unsigned long expire = slice_end;
+    unsigned long wait;
+    unsigned short now;
+
+    if (sleeping != NULLTASKID && task_tab[sleeping].wake_tick < deadline) {
+        deadline = task_tab[sleeping].wake_tick;
+    }
+    if (timer_next_expire(&expire) && expire < deadline) deadline = expire;
+    wait = (deadline > tick) ? (deadline - tick) * TIMER_COUNTS_PER_TICK - clock_frac : 0;
+    if (wait > TIMER_MAX_WAIT) wait = TIMER_MAX_WAIT;
+
+    now = TIMER_COUNT();
+    if ((unsigned short)(now - clock_last) + TIMER_MIN_WAIT > wait) {
+        TIMER_COMPARE((unsigned short)(now + TIMER_MIN_WAIT));
+    } else {
+        TIMER_COMPARE((unsigned short)(clock_last + wait));
+    }
+}
+#endif
+
 /* ===================================================================
  * sched
  * スケジューラ
@@ -291,17 +782,43 @@ TASK_ID_TYPE removeq(TASK_ID_TYPE *queue)
  * 概要:
  * Readyキューの先頭から次に実行するタスクを取り出し、next_taskにセットする。
  * 実行可能なタスクがない場合は無限ループで待機する。
+ * ティックレス動作では、時間待ちのタスクかソフトウェアタイマがあれば、
+ * 最も早い起床・満了時刻に TCMP1 を設定して割り込みを許可して止まり
+ * (TRAP #1 の中なので、止まる間だけ割り込みレベルを 0 に下げる。
+ *  その間もモニタの UART の送受信割り込みは処理される)、
+ * 起きる度に TCN1 を見て起床・満了を処理する。
+ * 選んだタスクのタイムスライスに合わせてタイマを設定する。
  * =================================================================== */
 void sched()
 {
     next_task = removeq(&ready);
     
+#ifdef MTK_TICKLESS
+    /* 時間待ちタスクの起床 (またはタイマのコールバックによる起床) を待つ */
+    while (next_task == NULLTASKID && (sleeping != NULLTASKID || timer_active > 0)) {
+        slice_end = tick + MTK_SLICE_TICKS; /* 待つ時間の上限 */
+        timer_program();
+        kernel_idle = 1;
+        IDLE_WAIT();
+        kernel_idle = 0;
+        clock_update();
+        wake_sleepers();
+        timer_wheel_advance();
+        next_task = removeq(&ready);
+    }
+#endif
+    
     if (next_task == NULLTASKID) {
         /* 実行可能タスクがない場合のアイドルループ */
         while (1) {
             /* 割り込み待ちなどを行うのが一般的だが、ここでは単純ループ */
         }
     }
+#ifdef MTK_TICKLESS
+    slice_end = tick + MTK_SLICE_TICKS;
+    timer_program();
+#endif
+    MTK_TRACE_EVENT(TRACE_SCHED, next_task);
 }
 
 /* ===================================================================
@@ -324,12 +841,60 @@ void sleep(int ch)
     
     /* セマフォの待ち行列に追加 */
     addq(&semaphore[ch].task_list, curr_task);
+    MTK_TRACE_EVENT(TRACE_SLEEP, ch);
     
     /* 次のタスクを決定し、切り替える */
     sched();
+    TRACE_SWITCH_POINT();
     swtch();
 }
 
+/* ===================================================================
+ * sleep_until_body
+ * 時間待ちの本体 (sleep_trap から TRAP #1 経由で呼ばれる)
+ *
+ * 引数:
+ * t: 起床時刻 (tick)
+ * 概要:
+ * tick が t に達していなければ、現在のタスクを時間待ちキューへ移して切り替える。
+ * =================================================================== */
+void sleep_until_body(unsigned long t)
+{
+#ifdef MTK_TICKLESS
+    clock_update();
+    if (tick >= t) return;
+
+    task_tab[curr_task].wake_tick = t;
+    task_tab[curr_task].status = WAITING;
+    add_sleeping(curr_task);
+    MTK_TRACE_EVENT(TRACE_DELAY, t - tick);
+
+    sched();
+    TRACE_SWITCH_POINT();
+    swtch();
+#else
+    (void)t; /* 周期動作では使わない (sleep_until が skipmt で待つ) */
+#endif
+}
+
+/* ===================================================================
+ * sleep_until
+ * tick が t になるまでタスクを休ませる
+ *
+ * 概要:
+ * ティックレス動作では時間待ちキューに入り、起床時刻まで切り替え・割り込みが
+ * 起きない。周期動作では tick が skipmt の度にも進むため、従来どおり
+ * skipmt を繰り返して待つ (時間待ちキューで待つと tick の進みが変わる)。
+ * =================================================================== */
+void sleep_until(unsigned long t)
+{
+#ifdef MTK_TICKLESS
+    while (tick < t) sleep_trap(t);
+#else
+    while (tick < t) skipmt();
+#endif
+}
+
 /* ===================================================================
  * wakeup
  * タスクの起床
@@ -352,6 +917,7 @@ void wakeup(int ch)
     
     /* Readyキューに追加 */
     addq(&ready, woken_task);        
+    MTK_TRACE_EVENT(TRACE_WAKEUP, woken_task);
 }
 
 /* ===================================================================
@@ -365,6 +931,7 @@ void wakeup(int ch)
  * =================================================================== */
 void p_body(int sem_id)
 {
+    MTK_TRACE_EVENT(TRACE_P, sem_id);
     semaphore[sem_id].count--;
     
     if (semaphore[sem_id].count < 0) {
@@ -383,6 +950,7 @@ void p_body(int sem_id)
  * =================================================================== */
 void v_body(int sem_id)
 {
+    MTK_TRACE_EVENT(TRACE_V, sem_id);
     semaphore[sem_id].count++;
     
     if (semaphore[sem_id].count <= 0) {
@@ -394,17 +962,45 @@ void v_body(int sem_id)
  * hard_clock_body
  * タイマ割り込み処理のC言語パート
  *
+ * 引数:
+ * from_irq: タイマ割り込みから呼ばれたとき 0 以外, skipmt からのとき 0
+ *           (mtk_asm.s の hard_clock が入口の SR の割り込みレベルを渡す)
  * 概要:
  * ティックカウントを更新し、現在のタスクをReadyキューに戻して、
  * ラウンドロビンスケジューリングのために次のタスクを決定する。
+ * 周期動作では、タイマ割り込みのときだけ1周期分の時刻を積算する (mtk_now_cycles 用)。
+ * 満了したソフトウェアタイマのコールバックも、ここで (割り込み禁止のまま) 呼ぶ。
+ * ティックレス動作では、割り込み・skipmt のどちらから呼ばれても
+ * tick を TCN1 の進みから求め、起床時刻になった時間待ちタスクを起こす。
+ * sched のアイドル待ち中に割り込んだ場合は、待ちを解くだけで何もしない
+ * (起床・満了の処理はアイドル待ちのループが行う。切り替え先を現在のタスクに
+ *  するので、戻った先の swtch は何もしない)。
  * =================================================================== */
-void hard_clock_body(void)
+void hard_clock_body(int from_irq)
 {
-    tick++;
-    
-    /* 現在のタスクをReadyキューの末尾に回す(ラウンドロビン) */
-    addq(&ready, curr_task);
-    
-    /* 次に実行するタスクを決定 */
-    sched();    
+#ifdef MTK_TICKLESS
+    if (kernel_idle) {
+        next_task = curr_task;
+        return;
+    }
+#endif
+    MTK_PROFILE_SCOPE(hard_clock) {
+#ifndef MTK_TICKLESS
+        if (from_irq) clock_period();
+        tick++;
+#else
+        (void)from_irq; /* 時刻は TCN1 から求める */
+        clock_update();
+        wake_sleepers();
+#endif
+        MTK_TRACE_EVENT(TRACE_CLOCK, tick);
+        timer_wheel_advance();
+        
+        /* 現在のタスクをReadyキューの末尾に回す(ラウンドロビン) */
+        addq(&ready, curr_task);
+        
+        /* 次に実行するタスクを決定 (切り替えは戻った先の hard_clock が swtch で行う) */
+        sched();    
+        TRACE_SWITCH_POINT();
+    }
 }
\ No newline at end of file
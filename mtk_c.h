@@ -7,7 +7,36 @@
 #define NULLTASKID     0       /* キューの終端 */
 #define NUMTASK        5       /* 最大タスク数 */
 #define NUMSEMAPHORE   3       /* セマフォの数*/
+#ifndef NUMPORT
+#define NUMPORT        2       /* シリアルポート数 (実機は UART1/UART2. ホスト実行時は増やせる) */
+#endif
+#ifdef MTK_HOST
+#define STKSIZE        (64 * 1024) /* ホスト実行時 (libc の printf とシグナル処理の分を確保) */
+#else
 #define STKSIZE        4096    /* スタックサイズ (5KB) */
+#endif
+
+/* tick の周波数 (1秒あたりの tick 数)
+ * MTK_TICKLESS を定義すると、周期割り込みの代わりに TCN1 の値から tick を求め、
+ * 次に起こすタスクの起床時刻かタイムスライスの終わりにだけ TCMP1 で割り込ませる。
+ * 定義しない場合はタイマ割り込み (50ms) と skipmt の度に tick が1進むので実時間ではなく、
+ * 値はゲームの調整に使っている実測値の目安である */
+#ifndef MTK_TICK_HZ
+#ifdef MTK_TICKLESS
+#define MTK_TICK_HZ    1000
+#else
+#define MTK_TICK_HZ    100
+#endif
+#endif
+#define MTK_TIMER_HZ   10000   /* TCN1 のカウント周波数 (モニタの SET_TIMER の設定. 0.1ms) */
+#define MTK_TIMER_PERIODIC 500 /* 周期動作の割り込み周期 (カウント数. mtk_asm.s の init_timer) */
+#define MTK_SLICE_TICKS ((MTK_TICK_HZ + 19) / 20) /* タイムスライス (50ms. MTK_TICKLESS 時) */
+/* ミリ秒を tick 数に直す (切り上げ. 周期動作では MTK_TICK_HZ の目安による換算) */
+#define MTK_MS_TO_TICKS(ms) (((unsigned long)(ms) * MTK_TICK_HZ + 999) / 1000)
+
+#if defined(MTK_TICKLESS) && (MTK_TIMER_HZ % MTK_TICK_HZ != 0)
+#error "MTK_TICK_HZ は MTK_TIMER_HZ の約数にすること"
+#endif
 
 /* タスクの状態 (status) 用の定数例 */
 #define UNDEFINED      0       /* 未定義 */
@@ -38,6 +67,7 @@ typedef struct {
     int priority;           /* 優先度 */
     int status;             /* タスクの状態 */
     TASK_ID_TYPE next;      /* キューの次の要素 */
+    unsigned long wake_tick; /* 時間待ちの起床時刻 (sleep_until) */
 } TCB_TYPE;
 
 /* スタック構造体 */
@@ -66,7 +96,98 @@ extern TASK_ID_TYPE curr_task;
 extern TASK_ID_TYPE new_task;
 extern TASK_ID_TYPE next_task;
 extern TASK_ID_TYPE ready;
+extern TASK_ID_TYPE sleeping;
 
 extern volatile unsigned long tick;
 
+
+/* ======================================
+ * ソフトウェアタイマ (タイマホイール)
+ * ====================================== */
+
+/* tick で満了するタイマ. 満了すると hard_clock の中 (割り込み禁止のまま) で func(arg) を呼ぶ。
+ * func は短時間で終わること。ブロックする関数 (P, sleep_until, inbyte, outbyte, printf) は呼べない
+ * (コールバック内からタイマを操作するときは timer_start_body / timer_stop_body を使う) */
+typedef struct MtkTimer {
+    void (*func)(void *arg); /* 満了時に呼ぶ関数 */
+    void *arg;               /* func に渡す引数 */
+    unsigned long expire;    /* 満了する tick (登録前は mtk_timer_start の delay) */
+    unsigned long period;    /* 周期 (tick. 0 なら1回限り) */
+    int active;              /* タイマホイールに登録中なら 1 */
+    struct MtkTimer *next;   /* 同じスロットの次のタイマ */
+} MtkTimer;
+
+/* delay tick 後に満了させる (period > 0 なら以後 period tick 毎). 登録中なら登録し直す */
+void mtk_timer_start(MtkTimer *t, unsigned long delay, unsigned long period,
+                     void (*func)(void *arg), void *arg);
+/* 登録を取り消す (登録されていなければ何もしない) */
+void mtk_timer_stop(MtkTimer *t);
+void timer_start_body(MtkTimer *t);
+void timer_stop_body(MtkTimer *t);
+
+/* ======================================
+ * 時刻・区間計測
+ * ====================================== */
+
+/* 高分解能の現在時刻 (TCN1 のカウント数. MTK_TIMER_HZ で進み、32bit で折り返す) */
+unsigned long mtk_now_cycles(void);
+
+/* 区間計測: MTK_PROFILE を定義したときだけ、続くブロックの所要時間を計測点毎に集計する
+ * 例: MTK_PROFILE_SCOPE(display) { display(game); }
+ * (ブロックから break/return で抜けると記録されない) */
+#ifdef MTK_PROFILE
+typedef struct MtkProf {
+    const char *name;       /* 計測点の名前 */
+    unsigned long count;    /* 回数 */
+    unsigned long total;    /* 合計 (カウント数) */
+    unsigned long max;      /* 最大 (カウント数) */
+    struct MtkProf *next;   /* 計測点の一覧 */
+} MtkProf;
+void mtk_prof_add(MtkProf *p, unsigned long cycles);
+/* 集計の表示 void mtk_prof_report(FILE *fp) は、stdio を使う側で宣言する */
+#define MTK_PROFILE_SCOPE(name) \
+    static MtkProf mtk_prof_##name = { #name, 0, 0, 0, 0 }; \
+    for (unsigned long mtk_prof_t0 = mtk_now_cycles(), mtk_prof_once = 1; mtk_prof_once; \
+         mtk_prof_once = 0, mtk_prof_add(&mtk_prof_##name, mtk_now_cycles() - mtk_prof_t0))
+#else
+#define MTK_PROFILE_SCOPE(name)
+#endif
+
+/* ======================================
+ * イベントトレース
+ * ====================================== */
+
+/* MTK_TRACE を定義したときだけ、カーネルの動作 (切り替え・P/V・待ち・割り込み) と
+ * ユーザの印 (MTK_TRACE_MARK) を時刻付きでリングバッファに記録する。
+ * 記録は mtk_trace_dump で文字列として書き出し、trace2chrome.py で
+ * Chrome の trace_event 形式 (chrome://tracing, Perfetto) に変換する */
+#ifndef MTK_TRACE_SIZE
+#define MTK_TRACE_SIZE 512     /* 記録件数 (2のべき乗. 1件8バイト) */
+#endif
+
+#define TRACE_SWITCH  1  /* タスク切り替え (arg = 切り替え先のタスク) */
+#define TRACE_SCHED   2  /* 次に実行するタスクの決定 (arg = 選んだタスク) */
+#define TRACE_P       3  /* P 操作 (arg = セマフォ) */
+#define TRACE_V       4  /* V 操作 (arg = セマフォ) */
+#define TRACE_SLEEP   5  /* セマフォ待ちに入る (arg = セマフォ) */
+#define TRACE_WAKEUP  6  /* 待ちタスクを起こす (arg = 起こしたタスク) */
+#define TRACE_DELAY   7  /* 時間待ちに入る (arg = 起床までの tick) */
+#define TRACE_CLOCK   8  /* hard_clock (arg = tick の下位16ビット) */
+#define TRACE_MARK    9  /* ユーザの印 (arg = 任意の番号) */
+
+#ifdef MTK_TRACE
+typedef struct {
+    unsigned long time;     /* mtk_now_cycles() */
+    unsigned char event;    /* TRACE_xxx */
+    unsigned char task;     /* 記録したときの curr_task */
+    unsigned short arg;     /* イベント毎の引数 */
+} MtkTraceRec;
+void mtk_trace(int event, int arg);
+/* 記録の書き出し void mtk_trace_dump(FILE *fp) は、stdio を使う側で宣言する */
+#define MTK_TRACE_EVENT(event, arg) mtk_trace(event, arg)
+#else
+#define MTK_TRACE_EVENT(event, arg)
+#endif
+#define MTK_TRACE_MARK(id) MTK_TRACE_EVENT(TRACE_MARK, id)
+
 #endif /* MTK_C_H */
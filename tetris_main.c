@@ -7,11 +7,13 @@
  * [概要]
  * MC68VZ328用マルチタスクカーネル上で動作する2人対戦型テトリス。
  * 2つのシリアルポートを利用して、対戦相手と画面情報を共有しながらプレイする。
+ * (ホスト実行時はポートを増やして最大4人対戦・観戦ポートにできる)
  *
  * [タスク構成]
- * 1. task1 (User Task 1): Player 1 (Port 0) のゲームロジック
- * 2. task2 (User Task 2): Player 2 (Port 1) のゲームロジック
- * 3. task_turbo_monitor : 時間経過を監視し、難易度上昇とLED演出を行う管理タスク
+ * 1. task_game          : 各プレイヤー (Port 0, 1, ...) のゲームロジック (player_table の順)
+ * 2. task_spectator     : 観戦ポートへの画面配信 (NUMPORT > NUM_PLAYERS の場合のみ)
+ * ターボ (時間経過による難易度上昇とLED演出) はタスクではなく、カーネルの
+ * ソフトウェアタイマから周期的に呼ばれる turbo_update が行う。
  *
  * [主な機能]
  * - 共有メモリとセマフォを用いたお邪魔ブロック攻撃
@@ -29,11 +31,20 @@
  * *************************************************************************** */
 
 /* --- メモリマップ定義 --- */
+#ifdef MTK_HOST
+/* ホスト実行時は I/O 領域の代わりにシャドウ領域へ書く (host_mtk.c) */
+extern unsigned char host_io_shadow[];
+#define IOBASE  ((unsigned long)host_io_shadow)
+#else
 #define IOBASE  0x00D00000
+#endif
 
 /* --- LEDアドレス定義 --- */
 /* 実機仕様に基づき，IOBASEからのオフセットで各LEDのアドレスを配列化 */
-unsigned char * const leds[8] = {
+#define LED_NUM      8    /* LED の個数 */
+#define LED_CHAR_ON  '#'  /* 点灯時に書く値 */
+#define LED_CHAR_OFF ' '  /* 消灯時に書く値 */
+unsigned char * const leds[LED_NUM] = {
     (unsigned char *)(IOBASE + 0x00000039), /* LED0 */
     (unsigned char *)(IOBASE + 0x0000003b), /* LED1 */
     (unsigned char *)(IOBASE + 0x0000003d), /* LED2 */
@@ -45,17 +56,34 @@ unsigned char * const leds[8] = {
 };
 
 /* --- 外部依存定義 (カーネル/ライブラリ) --- */
-extern FILE *com0in, *com0out;
-extern FILE *com1in, *com1out;
 extern void init_kernel(void);
 extern void set_task(void (*func)());
 extern void begin_sch(void);
 extern int inbyte(int ch);
 extern void skipmt(void);
+extern void sleep_until(unsigned long t);
 extern void P(int sem_id);
 extern void V(int sem_id);
 extern volatile unsigned long tick;
+#ifdef MTK_PROFILE
+extern void mtk_prof_report(FILE *fp);
+#endif
+#ifdef MTK_TRACE
+extern void mtk_trace_dump(FILE *fp);
+#endif
+extern volatile unsigned long port_tx_bytes[NUMPORT];
+extern void (*port_tap[NUMPORT])(int ch, const char *buf, int nbytes);
 extern SEMAPHORE_TYPE semaphore[NUMSEMAPHORE];
+#ifdef MTK_HOST
+/* ホスト実行時は csys68k.c の read/write を経由するストリームを使う */
+extern FILE *csys_fdopen(int fd, const char *mode);
+#define fdopen csys_fdopen
+/* フレーム境界を回線モデルに知らせる (遅延・送信待ちの集計用) */
+extern void host_line_frame(int ch);
+#define FRAME_MARK(port) host_line_frame(port)
+#else
+#define FRAME_MARK(port)
+#endif
 
 /* ***************************************************************************
  * 2. システム状態管理・調整パラメータ
@@ -77,37 +105,140 @@ volatile int g_system_phase = PHASE_IDLE;
 /* --- ターボ機能・実機調整用パラメータ (定数) --- */
 /* 以下の定数は実機でのゲームバランス調整に使用する */
 #define TURBO_MAX_LEVEL_TIME_SEC 180 /* MAXレベル(Lv8)到達までの所要時間 (秒) */
-#define TURBO_BASE_INTERVAL      600 /* レベル0時の基本落下速度 (tick) */
-#define TURBO_TICKS_PER_SEC      100 /* 1秒あたりのtick数 (カーネル仕様に依存) */
-#define TURBO_UPDATE_PERIOD      1   /* ターボ監視タスクの更新周期 (小さいほど高頻度) */
-#define TURBO_BLINK_CYCLE        1   /* MAX時の点滅速度調整 (N回に1回反転) */
+#define TURBO_BASE_INTERVAL      MTK_MS_TO_TICKS(6000) /* レベル0時の基本落下速度 (周期動作で 600 tick) */
+#define TURBO_TICKS_PER_SEC      MTK_TICK_HZ /* 1秒あたりのtick数 (mtk_c.h. カーネルの動作方式に依存) */
+#define TURBO_UPDATE_PERIOD      MTK_MS_TO_TICKS(50) /* turbo_update を呼ぶ周期 (プレイ中のみ. 周期動作で 5 tick) */
+#define TURBO_BLINK_MS           250 /* MAX時の点滅速度 (点灯・消灯それぞれの時間. ミリ秒) */
+#ifndef TURBO_START_SEC
+#define TURBO_START_SEC          0   /* 開始時点の経過時間 (秒. 180 で最初から Lv8. 負荷試験用) */
+#endif
 
 /* --- ターボシステム用共有変数 (計算結果保持用) --- */
-/* task_turbo_monitor が計算し、各ゲームタスクが読み取る */
+/* turbo_update が計算し、各ゲームタスクが読み取る */
 volatile unsigned long g_current_drop_interval = TURBO_BASE_INTERVAL;
 volatile int g_score_multiplier = 1;
 
-/* セマフォID定義 */
-#define SEM_GARBAGE_LOCK 0  /* お邪魔ブロック変数の排他制御用 */
-
 /* ***************************************************************************
  * 3. ゲーム設定 & エスケープシーケンス
  * *************************************************************************** */
 
 /* --- ゲームパラメータ --- */
+#ifndef NUM_PLAYERS
+#define NUM_PLAYERS  NUMPORT  /* 対戦人数 (ゲームタスク数. 1ポートに1人) */
+#endif
+#define PLAYER_TABLE_MAX 4    /* player_table の行数 (対戦人数の上限) */
+#define FIXED_SEED   0        /* 乱数の種を固定する場合に指定 (0=対戦毎に決める. 再現試験用) */
 #define FIELD_WIDTH  12       /* 壁を含むフィールド幅 */
 #define FIELD_HEIGHT 22       /* 壁を含むフィールド高さ */
 #define MINO_WIDTH   4        /* ミノのグリッドサイズ */
 #define MINO_HEIGHT  4        /* ミノのグリッドサイズ */
 #define OPPONENT_OFFSET_X 40  /* 相手画面を表示するX座標のオフセット */
-#define ANIMATION_DURATION 3  /* ライン消去アニメーションの長さ (tick) */
+#define ANIMATION_DURATION MTK_MS_TO_TICKS(30) /* ライン消去アニメーションの長さ (周期動作で 3 tick) */
+#ifndef COUNTDOWN_DELAY
+#ifdef MTK_TICKLESS
+#define COUNTDOWN_DELAY MTK_TICK_HZ /* カウントダウンの待機時間 (1秒. tick が実時間のとき) */
+#else
 #define COUNTDOWN_DELAY 10000 /* カウントダウンの待機時間 (実機調整値) */
-#define DISPLAY_POLL_INTERVAL 50 /* 入力待ち時の画面更新頻度 */
+#endif
+#endif
+#define DISPLAY_POLL_INTERVAL MTK_MS_TO_TICKS(500) /* 入力待ち時の定期描画の間隔 (周期動作で 50 tick) */
+#define FRAME_MAX_FPS  30     /* 1ポートあたりの最大フレームレート */
+#define FRAME_MIN_INTERVAL (MTK_TIMER_HZ / FRAME_MAX_FPS) /* フレーム間隔の下限 (mtk_now_cycles のカウント数) */
+#define TX_RATE_SHIFT  8      /* tx_rate の固定小数点の桁 (バイト/カウント × 2^8) */
+#define SNAP_READ_RETRY 2     /* 相手スナップショット読み取りの再試行回数 */
+#define REPLAY_MAX_EVENTS 4096 /* 1試合分の記録イベント数の上限 (1件4バイト) */
+#define LOG_GARBAGE 0x80      /* 記録の種類: お邪魔ラインのせり上がり (イベント以外) */
+#define LAT_BUCKETS 10        /* 入力遅延ヒストグラムの区間数 (0, 1, 2-3, 4-7, ..., 256以上 ms) */
+#define LAT_COUNTS_PER_MS (MTK_TIMER_HZ / 1000) /* 1ms あたりの mtk_now_cycles のカウント数 */
+#define LAT_BAR_MAX 20        /* ヒストグラム表示の棒の最大長 (文字) */
+
+/* --- ボット (無人対戦・負荷試験用) --- */
+#ifndef BOT_PORTS
+#define BOT_PORTS   0         /* 起動時からボットが操作するポート (bit0=Port0, bit1=Port1) */
+#endif
+#ifndef BOT_APS
+#define BOT_APS     10        /* ボットの1秒あたりの操作数 */
+#endif
+#define BOT_BEAM    4         /* 次のミノまで先読みする候補数 (0=先読みなし) */
+#define BOT_MAX_MOVES 16      /* 1つのミノに出す操作数の上限 (超えたらハードドロップ) */
+#define BOT_RETRY_TICKS (3 * TURBO_TICKS_PER_SEC) /* 結果画面から自動で再戦するまでの時間 */
+#define BOT_ACTION_TICKS(aps) ((aps) >= TURBO_TICKS_PER_SEC ? 1 : TURBO_TICKS_PER_SEC / (aps))
+/* 盤面評価の重み (消去行数は加点, それ以外は減点) */
+#define BOT_W_LINES  76
+#define BOT_W_HOLES  36
+#define BOT_W_HEIGHT 51
+#define BOT_W_BUMP   18
+#define BOT_SCORE_MIN (-0x7fffffffL) /* 置き場所なし */
+
+/* 攻撃 (お邪魔ライン) の送り先の決め方 */
+enum {
+    ROUTE_NEXT,    /* ポート番号順で次の生存者 (相手画面も固定) */
+    ROUTE_RANDOM,  /* 生存者から無作為に選ぶ */
+    ROUTE_HIGHEST  /* 生存者のうち積み上がりが最も高い相手 */
+};
+#ifndef ATTACK_ROUTE
+#define ATTACK_ROUTE ROUTE_NEXT
+#endif
+
+/* --- 観戦ポート (NUM_PLAYERS 番以降のポート. 試合を見るだけで操作はしない) --- */
+#define NUM_SPECTATORS (NUMPORT - NUM_PLAYERS) /* 観戦ポート数 (-DNUM_PLAYERS で空けたポート) */
+#define SPEC_RING_SIZE 8192   /* プレイヤー毎の配信リング (全画面描画1回分 + 余裕) */
+#define SPEC_CHUNK     128    /* 観戦ポートへ1回に書き出すバイト数 */
+
+#if NUMPORT > PLAYER_TABLE_MAX || NUM_PLAYERS > NUMPORT || \
+    NUM_PLAYERS + (NUM_SPECTATORS > 0) > NUMTASK
+#error "NUMPORT/NUM_PLAYERS must fit player_table and NUMTASK (players + spectator task)"
+#endif
+
+/* 公開スナップショット読み取り結果 */
+#define SNAP_SAME   0         /* 前回から更新なし */
+#define SNAP_NEW    1         /* 新しい内容を取り込んだ */
+#define SNAP_BUSY  (-1)       /* 相手が更新中 (次のフレームで再試行) */
+
+/* コンパイラによるメモリアクセスの並べ替えを禁止する (シーケンスカウンタの前後) */
+#define SNAP_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+/* 縮小表示は AMBIGUOUS_WIDTH によらず1セル1桁。半角扱いの端末では半分ブロックで
+ * 2行を1行に詰め、全角扱いの端末では (▀▄ が2桁になるので) 背景色付きの空白で1行ずつ表す */
+#if AMBIGUOUS_WIDTH == 1
+#define MINI_PACK_ROWS 2      /* 縮小表示の1行に詰めるフィールドの行数 */
+#else
+#define MINI_PACK_ROWS 1
+#endif
+#define MINI_ROWS      (FIELD_HEIGHT / MINI_PACK_ROWS) /* 縮小表示の行数 */
+#define MINI_CELL_COLS 1      /* 縮小表示の1セルの桁数 */
+
+/* --- スクロール高速化 (ライン消去・せり上がり時の再描画削減) --- */
+#ifndef SCROLL_ACCEL_DEFAULT
+#define SCROLL_ACCEL_DEFAULT 0 /* 各ポートの初期設定 (1=有効. 端末が DECLRMM/DECSLRM に対応していること) */
+#endif
+#define SCROLL_MAX_SHIFT    4  /* 検出する最大ずれ行数 */
+#define SCROLL_MAX_PASSES   3  /* 1フレームで行うスクロール操作の最大回数 */
+#define SCROLL_MIN_GAIN     20 /* スクロールする最小利得 (再描画を省けるセル数) */
+
+/* 行ビットマップ (bit i = フィールドの i 行目) */
+#define ALL_ROWS_MASK ((1UL << FIELD_HEIGHT) - 1)
 
 /* フィールドのセル値 */
 #define CELL_EMPTY  0
 #define CELL_WALL   1
 #define CELL_GHOST  10
+#define CELL_VALUES 11        /* セル値の種類 (cell_seq の列数. これ以外の値は "??" で表示) */
+#define CELL_SEQ_MAX 24       /* セル1つの送信バイト列の最大長 (24bit の前景色19 + グリフ最大4) */
+#define CELL_PACK_INVALID 0xF /* 4bit 詰めの行で「描画内容不明」を表す値 (どのセル値とも一致しない) */
+
+#if FIELD_WIDTH != 12
+#error "PackedRow は幅 12 列 (32bit + 16bit) を前提にしている"
+#endif
+
+/* --- 東アジアの文字幅が Ambiguous の文字 (■ □ ▀ ▄ █) の表示幅 --- */
+/* 端末の設定に合わせる (2: 全角扱い. 日本語環境の既定, 1: 半角扱い) */
+/* カーソル位置の記憶 (term_goto) もこの幅で進めるので、端末と違うと表示がずれる */
+#ifndef AMBIGUOUS_WIDTH
+#define AMBIGUOUS_WIDTH 2
+#endif
+#if AMBIGUOUS_WIDTH != 1 && AMBIGUOUS_WIDTH != 2
+#error "AMBIGUOUS_WIDTH は 1 か 2 にすること"
+#endif
 
 /* --- エスケープシーケンス (VT100互換) --- */
 #define ESC_CLS        "\x1b[2J"    /* 画面クリア */
@@ -118,8 +249,11 @@ volatile int g_score_multiplier = 1;
 #define ESC_CLR_LINE   "\x1b[K"     /* 行末まで消去 */
 #define ESC_INVERT_ON  "\x1b[?5h"   /* 画面反転 (フラッシュ演出用) */
 #define ESC_INVERT_OFF "\x1b[?5l"   /* 画面反転解除 */
+#define ESC_LRMM_ON    "\x1b[?69h"  /* 左右マージンモード有効 (DECLRMM) */
+#define ESC_LRMM_OFF   "\x1b[?69l"  /* 左右マージンモード解除 */
+#define ESC_MARGIN_RESET "\x1b[s\x1b[r" /* 左右・上下マージン解除 */
 
-/* --- カラー定義 (24bitカラーなど) --- */
+/* --- カラー定義 (24bitカラー) --- */
 #define COL_CYAN     "\x1b[38;2;0;255;255m"
 #define COL_YELLOW   "\x1b[38;2;255;255;0m"
 #define COL_PURPLE   "\x1b[38;2;160;32;240m"
@@ -130,7 +264,76 @@ volatile int g_score_multiplier = 1;
 #define COL_WHITE    "\x1b[38;2;255;255;255m"
 #define COL_GRAY     "\x1b[38;2;128;128;128m"
 #define COL_WALL     COL_WHITE
+#define COL_DEFAULT  "\x1b[39m"           /* 前景色のみ既定に戻す */
 #define BG_BLACK     "\x1b[40m"
+#define GLYPH_UPPER_HALF "▀"  /* 縮小表示: 上半分 */
+#define GLYPH_LOWER_HALF "▄"  /* 縮小表示: 下半分 */
+#define GLYPH_FULL_BLOCK "█"  /* 縮小表示: 上下とも同色 */
+#define GLYPH_MINI_BLANK " "  /* 縮小表示: 背景色だけのセル */
+#define GLYPH_MINI_BLOCK "#"  /* 縮小表示 (1行ずつ): ブロック */
+#define GLYPH_EMPTY   "・"    /* 空きセル (全角. 常に2桁) */
+#if AMBIGUOUS_WIDTH == 2
+#define GLYPH_BLOCK   "■"    /* 壁・ミノ */
+#define GLYPH_GHOST   "□"    /* ゴースト */
+#else
+#define GLYPH_BLOCK   "■ "   /* 壁・ミノ (半角扱いの端末では空白を足して2桁にする) */
+#define GLYPH_GHOST   "□ "   /* ゴースト */
+#endif
+#define GLYPH_INVALID "??"    /* 範囲外の値 */
+
+/* --- パレット番号 (端末状態トラッカが現在色の比較に使用) --- */
+enum {
+    PAL_DEFAULT, PAL_CYAN, PAL_YELLOW, PAL_PURPLE, PAL_BLUE,
+    PAL_ORANGE, PAL_GREEN, PAL_RED, PAL_WHITE, PAL_GRAY, PAL_MAX
+};
+#define PAL_UNKNOWN  (-1)   /* 端末側の色が不明 (次回必ず再送する) */
+#define PAL_KEEP     (-2)   /* 色指定の引数で「現在の色のまま」を表す */
+#define PAL_WALL     PAL_WHITE
+#define PAL_MINI     PAL_GRAY   /* 縮小表示のブロックの色 */
+
+/* --- カラープロファイル (ポート毎に選択, 通信量削減用) --- */
+/* 24bit: 約19バイト, 256色: 約11バイト, 16色: 5バイト / 1色指定 */
+enum {
+    COLOR_PROFILE_24BIT, /* ESC[38;2;r;g;bm */
+    COLOR_PROFILE_256,   /* ESC[38;5;Nm */
+    COLOR_PROFILE_16,    /* ESC[3Nm / ESC[9Nm */
+    COLOR_PROFILE_MAX
+};
+
+const char *paletteSeq[COLOR_PROFILE_MAX][PAL_MAX] = {
+    /* 24bit */
+    { COL_DEFAULT, COL_CYAN, COL_YELLOW, COL_PURPLE, COL_BLUE,
+      COL_ORANGE, COL_GREEN, COL_RED, COL_WHITE, COL_GRAY },
+    /* 256色 */
+    { COL_DEFAULT, "\x1b[38;5;51m", "\x1b[38;5;226m", "\x1b[38;5;129m", "\x1b[38;5;21m",
+      "\x1b[38;5;214m", "\x1b[38;5;46m", "\x1b[38;5;196m", "\x1b[38;5;231m", "\x1b[38;5;244m" },
+    /* 16色 (橙は暗い黄、灰は明るい黒で代用) */
+    { COL_DEFAULT, "\x1b[36m", "\x1b[93m", "\x1b[35m", "\x1b[34m",
+      "\x1b[33m", "\x1b[32m", "\x1b[31m", "\x1b[97m", "\x1b[90m" }
+};
+
+/* プロファイル名 (開始画面の表示用) */
+const char *colorProfileNames[COLOR_PROFILE_MAX] = { "24bit", "256", "16" };
+
+/* 背景色 (縮小表示で下半分の色に使用, PAL_DEFAULT は黒) */
+const char *paletteBgSeq[COLOR_PROFILE_MAX][PAL_MAX] = {
+    /* 24bit */
+    { BG_BLACK, "\x1b[48;2;0;255;255m", "\x1b[48;2;255;255;0m", "\x1b[48;2;160;32;240m",
+      "\x1b[48;2;0;0;255m", "\x1b[48;2;255;165;0m", "\x1b[48;2;0;255;0m", "\x1b[48;2;255;0;0m",
+      "\x1b[48;2;255;255;255m", "\x1b[48;2;128;128;128m" },
+    /* 256色 */
+    { BG_BLACK, "\x1b[48;5;51m", "\x1b[48;5;226m", "\x1b[48;5;129m", "\x1b[48;5;21m",
+      "\x1b[48;5;214m", "\x1b[48;5;46m", "\x1b[48;5;196m", "\x1b[48;5;231m", "\x1b[48;5;244m" },
+    /* 16色 */
+    { BG_BLACK, "\x1b[46m", "\x1b[103m", "\x1b[45m", "\x1b[44m",
+      "\x1b[43m", "\x1b[42m", "\x1b[41m", "\x1b[107m", "\x1b[100m" }
+};
+
+/* --- 相手画面の表示方式 --- */
+enum {
+    RIVAL_VIEW_FULL,    /* 自分と同じ大きさ (2桁/セル, 1行/行) */
+    RIVAL_VIEW_COMPACT  /* 縮小表示 (1桁/セル, 形のみ. draw_rival_compact) */
+};
 
 /* ***************************************************************************
  * 4. 構造体・データ型定義
@@ -151,24 +354,144 @@ typedef enum {
     EVT_QUIT       /* 強制終了 */
 } EventType;
 
+/* 入力記録の1件 (前の記録からの経過tick, 種類, パラメータ) */
+typedef struct {
+    unsigned short dt;    /* 前の記録からの経過tick (最初の1件はゲーム開始から) */
+    unsigned char type;   /* EventType または LOG_GARBAGE */
+    unsigned char param;  /* キーコード / せり上がり行数 */
+} LogEntry;
+
+/* 1試合分の入力記録 (タスクのスタックに載らないよう大域変数に置く) */
+typedef struct {
+    unsigned long seed;   /* 試合の乱数の種 */
+    int count;            /* 記録件数 (0=記録なし) */
+    int truncated;        /* 上限に達して記録を打ち切った */
+    LogEntry ev[REPLAY_MAX_EVENTS];
+} ReplayLog;
+
+/* 乱数生成器 (xorshift32. ゲーム毎に独立した状態を持つ) */
+typedef struct {
+    unsigned long s;
+} Rng;
+
+/* ボットの置き場所候補 */
+typedef struct {
+    int x, angle; /* 置く位置と向き */
+    long score;   /* 盤面評価値 */
+} BotMove;
+
 /* イベント構造体 */
 typedef struct {
     EventType type;
     int param;     /* キーコード等のパラメータ */
 } Event;
 
+/* 端末状態トラッカ (出力バイト数削減用) */
+/* 端末側のカーソル位置と表示属性を記憶し、変化した分だけを送信する */
+typedef struct {
+    int cur_y, cur_x; /* 現在のカーソル位置 (1始まり, cur_y=0 は位置不明) */
+    int fg;           /* 現在の前景色 (パレット番号, PAL_UNKNOWN=不明) */
+    int bg;           /* 現在の背景色 (パレット番号, PAL_DEFAULT=黒, PAL_UNKNOWN=既定または不明) */
+} TermState;
+
+/* ヘッダ行のキャッシュ (前回送信した値) */
+typedef struct {
+    int valid;          /* 0=画面クリア直後など (次回は全て描画) */
+    int score, multiplier, garbage;
+    int opp_id, opp_score, opp_lines;
+} HeaderCache;
+
+/* 観戦配信のリング (プレイヤー毎) */
+/* プレイヤーのポートへ送ったバイト列を1回だけ書き込み、全観戦ポートが各自の位置から読む */
+typedef struct {
+    unsigned char buf[SPEC_RING_SIZE];
+    volatile unsigned long head;    /* 書き込んだ総バイト数 (次に書く位置) */
+    volatile unsigned long reserve; /* 書き込み中の末尾 (reserve - SPEC_RING_SIZE 以降は上書きされ得る) */
+    volatile unsigned long key;     /* 直近のキーフレーム (画面クリアから始まる全画面) の開始位置 */
+    volatile unsigned long key_seq; /* キーフレームの通し番号 */
+    volatile int resync;            /* 観戦側からのキーフレーム要求 */
+    int subscribers;                /* 観戦中のポート数 (0 の間は書き込まない. 観戦タスクのみが書く) */
+} SpecFeed;
+
+/* 観戦ポート毎の状態 (観戦タスクのみが使う) */
+typedef struct {
+    int port;               /* ポート番号 */
+    FILE *fp;               /* 出力ストリーム */
+    int player;             /* 観戦中のプレイヤー (-1=なし) */
+    int waiting_key;        /* キーフレーム待ち (観戦開始直後・取りこぼし後) */
+    unsigned long key_seen; /* 待ち始めたときの key_seq */
+    unsigned long pos;      /* 次に送る位置 (リングの通し番号) */
+} Spectator;
+
+/* セル1つ分の送信バイト列 (init_cell_seq がカラープロファイル・セル値毎に作る) */
+typedef struct {
+    char bytes[CELL_SEQ_MAX]; /* 前景色の指定 + グリフ (UTF-8) */
+    unsigned char len;        /* 全体の長さ */
+    unsigned char glyph_len;  /* 末尾のグリフの長さ (前景色が同じときはここだけ送る) */
+    signed char pal;          /* 前景色 (パレット番号) */
+} CellSeq;
+
+/* 描画バッファの1行 (セル値を 4bit ずつ詰める. 左の列ほど上位のニブル)
+ * 実機では 6 バイトで、行の一致判定は 32bit と 16bit の比較 2 回で済む */
+typedef struct {
+    unsigned int hi;    /* 列 0〜7 */
+    unsigned short lo;  /* 列 8〜11 */
+} PackedRow;
+
+/* プレイヤー (ゲームタスク) 毎の設定. main がこの表からタスクを登録する */
+typedef struct {
+    int fd;             /* 出力先の FD (csys68k.c の FD 表でポートに対応) */
+    int color_profile;  /* カラープロファイルの初期値 */
+} PlayerConfig;
+
 /* テトリスゲーム管理構造体 */
 typedef struct {
     /* 通信・IO関連 */
-    int port_id;   /* 0:UART1, 1:UART2 */
+    int port_id;   /* 0:UART1, 1:UART2, (ホスト実行時) 2〜: 追加ポート */
     FILE *fp_out;  /* 出力ストリーム */
+    TermState term; /* 出力先端末の状態 */
+    int color_profile; /* カラープロファイル (COLOR_PROFILE_*) */
+    HeaderCache hdr;   /* ヘッダ行の送信済み内容 */
+    int rival_view;    /* 相手画面の表示方式 (RIVAL_VIEW_*) */
+    int scroll_accel;  /* 1=行のずれを端末のスクロールで移動する (左右マージン対応の端末のみ) */
     
     /* 画面バッファ (ダブルバッファリング用) */
     char field[FIELD_HEIGHT][FIELD_WIDTH];              /* 現在のフィールド状態 */
-    char displayBuffer[FIELD_HEIGHT][FIELD_WIDTH];      /* 描画用バッファ */
-    char prevBuffer[FIELD_HEIGHT][FIELD_WIDTH];         /* 前回描画した内容 (自分) */
-    char prevOpponentBuffer[FIELD_HEIGHT][FIELD_WIDTH]; /* 前回描画した内容 (相手) */
-    int opponent_was_connected;                         /* 相手接続フラグ */
+    PackedRow displayBuffer[FIELD_HEIGHT];              /* 描画用バッファ */
+    PackedRow prevBuffer[FIELD_HEIGHT];                 /* 前回描画した内容 (自分. 0xF=不明) */
+    PackedRow prevOpponentBuffer[FIELD_HEIGHT];         /* 前回描画した内容 (相手. 0xF=不明) */
+    unsigned char prevMiniBuffer[MINI_ROWS][FIELD_WIDTH]; /* 前回描画した内容 (相手・縮小表示) */
+    int opp_view_id;                                    /* 相手画面に表示中のプレイヤー (-1=なし) */
+
+    /* 差分描画の対象行管理 (ゲームロジックが書き込み時に印を付ける) */
+    unsigned long dirty_rows;   /* displayBuffer を作り直す行 */
+    int piece_dirty;            /* ミノが移動・回転・交代した (ゴースト再計算が必要) */
+    unsigned long piece_rows;   /* 前回描画時にミノ・ゴーストが占めていた行 */
+    int ghostY;                 /* ゴーストのY座標 (piece_dirty 時に再計算) */
+    volatile unsigned long frame_no;           /* displayBuffer の更新回数 */
+    volatile unsigned long row_stamp[FIELD_HEIGHT]; /* 各行が最後に変化した frame_no */
+    volatile unsigned long row_chg_base[FIELD_HEIGHT]; /* その1つ前に行が変化した frame_no */
+    volatile unsigned short row_chg[FIELD_HEIGHT];  /* 最後の変化で値が変わった列 (bit j=列 j. 変化リスト) */
+    unsigned long own_force_rows; /* 自分の画面で全列を比較する行 (prevBuffer 無効化時) */
+    unsigned long opp_seen_frame; /* 相手の何フレーム目まで描画したか */
+    unsigned long opp_force_rows; /* 相手画面で無条件に比較する行 (prevOpponentBuffer 無効化時) */
+    unsigned short opp_chg[FIELD_HEIGHT]; /* 相手画面で比較する列 (取り込んだ行毎) */
+
+    /* 公開スナップショット (相手タスクが読む. snap_seq が奇数の間は書き込み中) */
+    /* displayBuffer, row_stamp, row_chg_base, row_chg, frame_no, pub_score, pub_lines を snap_seq で保護する */
+    volatile unsigned long snap_seq;
+    int pub_score, pub_lines;
+
+    /* 相手スナップショットの読み取り側コピー */
+    PackedRow oppSnapshot[FIELD_HEIGHT];
+    unsigned long opp_snap_seq;   /* 取り込み済みの相手 snap_seq (奇数=未取り込み) */
+    int opp_score, opp_lines;
+
+    /* フレームレート制御 (状態変化をまとめて1フレームで描画する) */
+    int frame_pending;              /* 未描画の状態変化あり */
+    unsigned long next_frame;       /* 次のフレームを描画してよい時刻 (mtk_now_cycles) */
+    unsigned long tx_rate;          /* 実測送信レート (バイト/カウント, TX_RATE_SHIFT の固定小数点) */
+    unsigned long next_poll_tick;   /* 入力待ち中に次の定期描画を要求する時刻 */
     
     /* 進行状態 */
     GameState state;
@@ -179,6 +502,32 @@ typedef struct {
     int minoType, minoAngle, minoX, minoY;
     int nextMinoType, prevNextMinoType;
     int bag[7], bag_index; /* 7種1巡生成用バッグ */
+
+    /* 乱数 (対戦開始時に両者で合意した種から初期化する) */
+    Rng bag_rng;        /* ミノの順番と出現角度 (両者で同じ系列になる) */
+    Rng aux_rng;        /* お邪魔ラインの穴位置 */
+    Rng route_rng;      /* 攻撃先の無作為選択 (ROUTE_RANDOM) */
+    volatile unsigned long seed_proposal; /* 自分が提案した種 (同期前に公開) */
+    unsigned long match_seed;             /* 合意した種 */
+
+    /* 入力記録・再生 */
+    int replay;                 /* 1=記録からイベントを再生中 */
+    int replay_pos;             /* 次に再生する記録の位置 */
+    unsigned long log_tick;     /* 直前に記録 (再生) したイベントの時刻 */
+
+    /* 入力→画面反映の遅延計測 (tick. 1試合分) */
+    int input_pending;           /* まだフレームに反映していない入力あり */
+    unsigned long input_cycles;  /* その最初の入力を受け取った時刻 (mtk_now_cycles) */
+    unsigned long lat_hist[LAT_BUCKETS]; /* 遅延のヒストグラム (区間は2のべき乗 ms) */
+    unsigned long lat_count, lat_sum, lat_max; /* 件数と合計・最大 (mtk_now_cycles のカウント数) */
+
+    /* ボット (bot_aps > 0 の間、キー入力がなければボットが操作する) */
+    int bot_aps;                 /* 1秒あたりの操作数 (0=ボットなし) */
+    unsigned long bot_next_tick; /* 次に操作してよい時刻 */
+    unsigned long piece_no;      /* 出現したミノの通し番号 */
+    unsigned long bot_piece;     /* 目標を決めたミノの通し番号 */
+    int bot_x, bot_angle;        /* 目標の置き場所 */
+    int bot_moves;               /* 現在のミノに出した操作数 */
     
     /* タイミング・入力制御 */
     unsigned long next_drop_time;
@@ -187,18 +536,45 @@ typedef struct {
     /* スコア・統計・共有情報 (他タスクから参照される変数はvolatile) */
     int score;
     int lines_cleared;
-    volatile int pending_garbage; /* 受け取ったお邪魔ライン数 */
+    /* お邪魔ブロックの受信箱 (送信元ごとの累計. 各要素の書き込み者は1タスクのみ) */
+    volatile unsigned long garbage_sent[NUM_PLAYERS]; /* 送信元が加算する送信累計 */
+    unsigned long garbage_taken[NUM_PLAYERS];         /* 自分がせり上げ済みの累計 */
     volatile int is_gameover;     /* ゲームオーバー状態 */
+    volatile int stack_height;    /* 積み上がりの高さ (ROUTE_HIGHEST 用. ミノ固定時に更新) */
+    int target;                   /* 攻撃先・相手画面のプレイヤー (-1=なし) */
     volatile int sync_generation; /* 開始同期用世代カウンタ */
 } TetrisGame;
 
 /* 相手タスク参照用ポインタ配列 */
-TetrisGame *all_games[2] = {NULL, NULL};
+TetrisGame *all_games[NUM_PLAYERS] = {NULL};
+FILE *player_out[NUM_PLAYERS]; /* プレイヤー毎の出力ストリーム (main で開く) */
+
+/* プレイヤー毎の設定 (Player 1 は標準出力, Player 2 は FD 4 = Port1, ...) */
+/* 観戦ポートにした行 (NUM_PLAYERS 行目以降) は FD だけを使う */
+const PlayerConfig player_table[PLAYER_TABLE_MAX] = {
+    { 1, COLOR_PROFILE_24BIT }, /* Player 1: Port0 (UART1) */
+    { 4, COLOR_PROFILE_24BIT }, /* Player 2: Port1 (UART2) */
+    { 5, COLOR_PROFILE_24BIT }, /* Player 3: Port2 (ホスト実行時のみ) */
+    { 6, COLOR_PROFILE_24BIT }  /* Player 4: Port3 (ホスト実行時のみ) */
+};
+
+/* セルの送信バイト列 [プロファイル][セル値] (最後の列は範囲外の値用) */
+CellSeq cell_seq[COLOR_PROFILE_MAX][CELL_VALUES + 1];
+
+#if NUM_SPECTATORS > 0
+/* 観戦配信 (プレイヤー毎のリングと観戦ポート毎の状態) */
+SpecFeed spec_feeds[NUM_PLAYERS];
+Spectator spectators[NUM_SPECTATORS];
+#endif
+
+/* 直前の試合の入力記録 (ポート毎) */
+ReplayLog replay_logs[NUM_PLAYERS];
+volatile int g_replay_generation = -1; /* 再生を要求された sync_generation */
 
 /* ミノ定義 */
 enum { MINO_TYPE_I, MINO_TYPE_O, MINO_TYPE_S, MINO_TYPE_Z, MINO_TYPE_J, MINO_TYPE_L, MINO_TYPE_T, MINO_TYPE_GARBAGE, MINO_TYPE_MAX };
 enum { MINO_ANGLE_0, MINO_ANGLE_90, MINO_ANGLE_180, MINO_ANGLE_270, MINO_ANGLE_MAX };
-const char* minoColors[MINO_TYPE_MAX] = { COL_CYAN, COL_YELLOW, COL_GREEN, COL_RED, COL_BLUE, COL_ORANGE, COL_PURPLE, COL_GRAY };
+const int minoPalette[MINO_TYPE_MAX] = { PAL_CYAN, PAL_YELLOW, PAL_GREEN, PAL_RED, PAL_BLUE, PAL_ORANGE, PAL_PURPLE, PAL_GRAY };
 
 /* ミノ形状データ [種類][角度][y][x] */
 char minoShapes[MINO_TYPE_MAX][MINO_ANGLE_MAX][MINO_HEIGHT][MINO_WIDTH] = {
@@ -216,38 +592,504 @@ char minoShapes[MINO_TYPE_MAX][MINO_ANGLE_MAX][MINO_HEIGHT][MINO_WIDTH] = {
  * 5. 関数プロトタイプ宣言
  * *************************************************************************** */
 int  isHit(TetrisGame *game, int _minoX, int _minoY, int _minoType, int _minoAngle);
-void print_cell_content(FILE *fp, char cellVal);
+unsigned long row_range_mask(int top, int bottom);
+void mark_field_rows(TetrisGame *game, int top, int bottom);
+void mark_piece_dirty(TetrisGame *game);
+int  idle_poll(TetrisGame *game);
+Event read_event(TetrisGame *game);
+Event replay_event(TetrisGame *game);
+void log_begin(TetrisGame *game);
+void log_append(TetrisGame *game, int type, int param);
+void rng_seed(Rng *rng, unsigned long seed);
+unsigned long rng_next(Rng *rng);
+int  rng_range(Rng *rng, int n);
+void propose_seed(TetrisGame *game);
+void agree_seed(TetrisGame *game);
+void send_garbage(TetrisGame *from, TetrisGame *to, int lines);
+int  player_alive(int id);
+int  alive_opponents(TetrisGame *game);
+int  next_alive(TetrisGame *game);
+TetrisGame *current_target(TetrisGame *game);
+TetrisGame *route_attack(TetrisGame *game);
+void update_stack_height(TetrisGame *game);
+void match_end_phase(TetrisGame *game);
+void wait_players(TetrisGame *game);
+int  garbage_pending(TetrisGame *game);
+int  take_garbage(TetrisGame *game, int max_lines);
+void discard_garbage(TetrisGame *game);
+unsigned long bot_put(TetrisGame *game, int x, int y, int type, int angle, char val);
+long bot_evaluate(TetrisGame *game, unsigned long full);
+long bot_best_next(TetrisGame *game, unsigned long full);
+void bot_plan(TetrisGame *game);
+int  bot_input(TetrisGame *game);
+void term_invalidate(TetrisGame *game);
+void term_goto(TetrisGame *game, int y, int x);
+void term_set_color(TetrisGame *game, int pal);
+void term_set_colors(TetrisGame *game, int fg, int bg);
+void term_reset_attr(TetrisGame *game);
+void init_cell_seq(void);
+void print_cell_content(TetrisGame *game, char cellVal);
+int  pr_get(const PackedRow *r, int j);
+void pr_pack(PackedRow *r, const char *cells);
+unsigned short pr_diff(const PackedRow *a, const PackedRow *b);
+int  pr_match(const PackedRow *a, const PackedRow *b);
+int  scroll_field_view(TetrisGame *game, const PackedRow *src, PackedRow *prev,
+                       unsigned long *rows, int top_y, int left_x);
+int  cell_palette(char cellVal);
+int  term_color_cost(TetrisGame *game, int fg, int bg);
+int  draw_rival_compact(TetrisGame *game, const PackedRow *src, unsigned long rows, int top_y);
+int  read_opponent_snapshot(TetrisGame *game, TetrisGame *opponent, unsigned long *rows);
 void display(TetrisGame *game);
+void request_display(TetrisGame *game);
+void present_frame(TetrisGame *game);
+void latency_record(TetrisGame *game);
+void show_latency(TetrisGame *game);
+#if NUM_SPECTATORS > 0
+void spec_tap(int ch, const char *buf, int nbytes);
+void spec_keyframe(TetrisGame *game);
+void spec_resync(TetrisGame *game);
+void spec_banner(Spectator *sp);
+void spec_watch(Spectator *sp, int player);
+int  spec_pump(Spectator *sp);
+void task_spectator(void);
+#else
+/* 観戦ポートがなければ何もしない */
+#define spec_keyframe(game)
+#define spec_resync(game)
+#endif
 void perform_countdown(TetrisGame *game);
 void wait_start(TetrisGame *game);
 void wait_retry(TetrisGame *game);
 void show_gameover_message(TetrisGame *game);
 void show_victory_message(TetrisGame *game);
 void run_tetris(TetrisGame *game);
-void task_turbo_monitor(void);
+void led_init(void);
+void led_set(unsigned char state);
+void turbo_update(void *arg);
+void turbo_phase(int phase);
+void task_game(void);
 
 /* ***************************************************************************
  * 6. 描画・表示関連関数
  * *************************************************************************** */
 
+/* ---------------------------------------------------------------------------
+ * 関数名 : term_invalidate
+ * 概要   : 端末状態を「不明」にする
+ * 詳細   : 
+ * 画面クリアやメッセージ表示など、トラッカを経由しない出力の後に呼ぶ。
+ * 次のカーソル移動は絶対指定、次の色指定は必ず再送となる。
+ * --------------------------------------------------------------------------- */
+void term_invalidate(TetrisGame *game) {
+    game->term.cur_y = 0;
+    game->term.cur_x = 0;
+    game->term.fg = PAL_UNKNOWN;
+    game->term.bg = PAL_UNKNOWN;
+}
+
+/* 10進表記の桁数 (シーケンス長の見積もり用) */
+int dec_len(int n) {
+    int len = 1;
+    while (n >= 10) { n /= 10; len++; }
+    return len;
+}
+
+/* 相対移動 ESC[nX の長さ (n=1 のときは数字を省略できる) */
+int rel_move_len(int n) {
+    return (n == 1) ? 3 : 3 + dec_len(n);
+}
+
+/* 相対移動 ESC[nX の出力 */
+void emit_rel_move(FILE *fp, int n, char dir) {
+    if (n == 1) fprintf(fp, "\x1b[%c", dir);
+    else        fprintf(fp, "\x1b[%d%c", n, dir);
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : term_goto
+ * 概要   : カーソルを (y, x) へ移動する (最短のシーケンスを選択)
+ * 引数   : game - ゲームインスタンス
+ * y, x - 移動先 (1始まり)
+ * 詳細   : 
+ * 既に目的位置にあれば何も送らない。同じ行なら相対移動 (CUF/CUB) と
+ * 列指定 (CHA) の短い方、別の行なら絶対指定 (CUP) と相対移動の組合せの
+ * 短い方を選ぶ。
+ * --------------------------------------------------------------------------- */
+void term_goto(TetrisGame *game, int y, int x) {
+    TermState *t = &game->term;
+    FILE *fp = game->fp_out;
+
+    if (t->cur_y == y && t->cur_x == x) return;
+
+    if (t->cur_y != 0) {
+        int dy = y - t->cur_y;
+        int dx = x - t->cur_x;
+        int ady = (dy > 0) ? dy : -dy;
+        int adx = (dx > 0) ? dx : -dx;
+        int abs_len = 4 + dec_len(y) + dec_len(x);
+        int col_len = 0;
+        int use_cha = 0;
+
+        if (dx != 0) {
+            col_len = rel_move_len(adx);
+            if (3 + dec_len(x) < col_len) { col_len = 3 + dec_len(x); use_cha = 1; }
+        }
+        if ((dy == 0 ? 0 : rel_move_len(ady)) + col_len < abs_len) {
+            if (dy != 0) emit_rel_move(fp, ady, (dy > 0) ? 'B' : 'A');
+            if (dx != 0) {
+                if (use_cha) fprintf(fp, "\x1b[%dG", x);
+                else         emit_rel_move(fp, adx, (dx > 0) ? 'C' : 'D');
+            }
+            t->cur_y = y; t->cur_x = x;
+            return;
+        }
+    }
+    fprintf(fp, "\x1b[%d;%dH", y, x);
+    t->cur_y = y; t->cur_x = x;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : term_set_colors
+ * 概要   : 前景色・背景色を設定する
+ * 詳細   : 端末側の属性と異なる部分だけを送信する。
+ * PAL_KEEP を指定した側は変更しない。
+ * --------------------------------------------------------------------------- */
+void term_set_colors(TetrisGame *game, int fg, int bg) {
+    TermState *t = &game->term;
+    if (bg != PAL_KEEP && t->bg != bg) {
+        fputs(paletteBgSeq[game->color_profile][bg], game->fp_out);
+        t->bg = bg;
+    }
+    if (fg != PAL_KEEP && t->fg != fg) {
+        fputs(paletteSeq[game->color_profile][fg], game->fp_out);
+        t->fg = fg;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : term_set_color
+ * 概要   : セル描画用の属性 (背景黒 + 前景色) を設定する
+ * --------------------------------------------------------------------------- */
+void term_set_color(TetrisGame *game, int pal) {
+    term_set_colors(game, pal, PAL_DEFAULT);
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : term_reset_attr
+ * 概要   : 表示属性を既定に戻す (既に既定なら何も送らない)
+ * 詳細   : ヘッダ等の文字列をセルの色で表示しないために使用する。
+ * --------------------------------------------------------------------------- */
+void term_reset_attr(TetrisGame *game) {
+    TermState *t = &game->term;
+    if (t->bg != PAL_UNKNOWN || t->fg != PAL_DEFAULT) {
+        fputs(ESC_RESET, game->fp_out);
+        t->bg = PAL_UNKNOWN;
+        t->fg = PAL_DEFAULT;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : cell_palette
+ * 概要   : セルの値から表示色 (パレット番号) を求める
+ * --------------------------------------------------------------------------- */
+int cell_palette(char cellVal) {
+    if (cellVal == CELL_WALL)  return PAL_WALL;
+    if (cellVal == CELL_GHOST) return PAL_GRAY;
+    if (cellVal >= 2 && cellVal <= 9) return minoPalette[cellVal - 2];
+    return PAL_DEFAULT;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : init_cell_seq
+ * 概要   : セルの送信バイト列の表 (cell_seq) を作る (起動時に1回呼ぶ)
+ * 詳細   : 
+ * カラープロファイルとセル値の組毎に、前景色のシーケンスとグリフを
+ * 連結したバイト列と、その長さを求めておく。
+ * --------------------------------------------------------------------------- */
+void init_cell_seq(void) {
+    int p, v;
+
+    for (p = 0; p < COLOR_PROFILE_MAX; p++) {
+        for (v = 0; v <= CELL_VALUES; v++) {
+            CellSeq *cs = &cell_seq[p][v];
+            const char *glyph;
+            int pal = (v < CELL_VALUES) ? cell_palette(v) : PAL_DEFAULT;
+            int col_len = strlen(paletteSeq[p][pal]);
+
+            if (v == CELL_EMPTY)                glyph = GLYPH_EMPTY;
+            else if (v == CELL_GHOST)           glyph = GLYPH_GHOST;
+            else if (v >= 1 && v <= 9)          glyph = GLYPH_BLOCK;
+            else                                glyph = GLYPH_INVALID;
+            cs->glyph_len = strlen(glyph);
+            cs->len = col_len + cs->glyph_len;
+            cs->pal = pal;
+            memcpy(cs->bytes, paletteSeq[p][pal], col_len);
+            memcpy(cs->bytes + col_len, glyph, cs->glyph_len);
+        }
+    }
+}
+
 /* ---------------------------------------------------------------------------
  * 関数名 : print_cell_content
  * 概要   : セル1つ分の描画内容を出力ストリームに書き込む
- * 引数   : fp      - 出力先ファイルポインタ
+ * 引数   : game    - 出力先のゲームインスタンス
  * cellVal - セルの値 (0:空, 1:壁, 2-9:ミノ, 10:ゴースト)
+ * 詳細   : 
+ * 色は直前のセルと異なる場合のみ送信し、セル毎の属性リセットは行わない。
+ * 送るバイト列は cell_seq から取り出し、前景色が変わる場合は表の全体を、
+ * 変わらない場合は末尾のグリフだけを1回の fwrite で書き込む
+ * (背景色の戻しが必要な場合だけ先に term_set_colors を通す)。
+ * どのグリフも2桁 (AMBIGUOUS_WIDTH に合わせて選んである) なので、描画後は
+ * カーソルを2桁進める。
  * --------------------------------------------------------------------------- */
-void print_cell_content(FILE *fp, char cellVal) {
-    if (cellVal == CELL_EMPTY) {
-        fprintf(fp, "%s・%s", BG_BLACK, ESC_RESET);
-    } else if (cellVal == CELL_WALL) {
-        fprintf(fp, "%s%s■%s", BG_BLACK, COL_WALL, ESC_RESET);
-    } else if (cellVal == CELL_GHOST) {
-        fprintf(fp, "%s%s□%s", BG_BLACK, COL_GRAY, ESC_RESET);
-    } else if (cellVal >= 2 && cellVal <= 9) {
-        fprintf(fp, "%s%s■%s", BG_BLACK, minoColors[cellVal - 2], ESC_RESET);
+void print_cell_content(TetrisGame *game, char cellVal) {
+    TermState *t = &game->term;
+    const CellSeq *cs = &cell_seq[game->color_profile]
+                                 [((unsigned char)cellVal < CELL_VALUES) ? cellVal : CELL_VALUES];
+
+    if (t->bg != PAL_DEFAULT) term_set_colors(game, PAL_KEEP, PAL_DEFAULT);
+    if (t->fg == cs->pal) {
+        fwrite(cs->bytes + cs->len - cs->glyph_len, 1, cs->glyph_len, game->fp_out);
     } else {
-        fprintf(fp, "??");
+        fwrite(cs->bytes, 1, cs->len, game->fp_out);
+        t->fg = cs->pal;
     }
+    t->cur_x += 2;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : term_color_cost
+ * 概要   : 指定の色にするために送信が必要なバイト数を返す
+ * --------------------------------------------------------------------------- */
+int term_color_cost(TetrisGame *game, int fg, int bg) {
+    int cost = 0;
+    if (fg != PAL_KEEP && game->term.fg != fg) cost += strlen(paletteSeq[game->color_profile][fg]);
+    if (bg != PAL_KEEP && game->term.bg != bg) cost += strlen(paletteBgSeq[game->color_profile][bg]);
+    return cost;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : draw_rival_compact
+ * 概要   : 相手フィールドの縮小表示 (差分描画)
+ * 引数   : game     - 出力先のゲームインスタンス
+ * src      - 相手フィールドのスナップショット
+ * rows     - 相手が更新したフィールド行
+ * top_y    - 表示先頭行の画面Y座標
+ * 戻り値 : 描画したセル数
+ * 詳細   : 
+ * 1セルを1桁で表し、ミノの色は区別せずに形だけを PAL_MINI の1色で描く
+ * (色の指定がほとんど要らず、通常表示の半分未満の送信量になる)。
+ * ゴーストは縮小表示では空として扱う。
+ * MINI_PACK_ROWS が 2 のときはフィールドの2行を画面1行に詰め、上下のセルを
+ * 半分ブロック (▀ / ▄) の前景色と背景色に割り当てる。同じ見た目になる候補
+ * (▀ と ▄ の入れ替え、同色なら █ か背景色付き空白) のうち、現在の端末の色から
+ * 変更が少なくて済むものを選ぶ。
+ * MINI_PACK_ROWS が 1 のとき (▀▄ が2桁になる端末) は1行ずつ、ブロックを
+ * ASCII 文字 (GLYPH_MINI_BLOCK) で表す。
+ * 差分は (上, 下) の組で prevMiniBuffer と比較する。
+ * --------------------------------------------------------------------------- */
+int draw_rival_compact(TetrisGame *game, const PackedRow *src, unsigned long rows, int top_y) {
+    int k, j;
+    int changes = 0;
+
+    for (k = 0; k < MINI_ROWS; k++) {
+        if (!(rows & (((1UL << MINI_PACK_ROWS) - 1) << (k * MINI_PACK_ROWS)))) continue;
+        for (j = 0; j < FIELD_WIDTH; j++) {
+            char top = pr_get(&src[k * MINI_PACK_ROWS], j);
+            char bottom = pr_get(&src[k * MINI_PACK_ROWS + MINI_PACK_ROWS - 1], j);
+            unsigned char pair;
+
+            /* 縮小表示は形だけを表す (ゴーストは空、それ以外は1色) */
+            top = (top != CELL_EMPTY && top != CELL_GHOST);
+            bottom = (bottom != CELL_EMPTY && bottom != CELL_GHOST);
+            pair = (unsigned char)((top << 4) | bottom);
+            if (pair == game->prevMiniBuffer[k][j]) continue;
+
+            term_goto(game, top_y + k, OPPONENT_OFFSET_X + j * MINI_CELL_COLS);
+            {
+                int tp = top ? PAL_MINI : PAL_DEFAULT;
+                int bp = bottom ? PAL_MINI : PAL_DEFAULT;
+
+                if (MINI_PACK_ROWS == 1) {
+                    /* 1行ずつ: ブロックは前景色の ASCII 文字 (背景は変えない) */
+                    if (top) term_set_colors(game, PAL_MINI, PAL_DEFAULT);
+                    else     term_set_colors(game, PAL_KEEP, PAL_DEFAULT);
+                    fputs(top ? GLYPH_MINI_BLOCK : GLYPH_MINI_BLANK, game->fp_out);
+                } else if (tp == bp) {
+                    /* 上下同色: 背景色だけの空白か、前景色だけの全ブロック */
+                    if (term_color_cost(game, tp, PAL_KEEP) == 0 && tp != PAL_DEFAULT) {
+                        fputs(GLYPH_FULL_BLOCK, game->fp_out);
+                    } else {
+                        term_set_colors(game, PAL_KEEP, tp);
+                        fputs(GLYPH_MINI_BLANK, game->fp_out);
+                    }
+                } else if (top == CELL_EMPTY) {
+                    term_set_colors(game, bp, PAL_DEFAULT);
+                    fputs(GLYPH_LOWER_HALF, game->fp_out);
+                } else if (bottom == CELL_EMPTY) {
+                    term_set_colors(game, tp, PAL_DEFAULT);
+                    fputs(GLYPH_UPPER_HALF, game->fp_out);
+                } else if (term_color_cost(game, tp, bp) <= term_color_cost(game, bp, tp)) {
+                    term_set_colors(game, tp, bp);
+                    fputs(GLYPH_UPPER_HALF, game->fp_out);
+                } else {
+                    term_set_colors(game, bp, tp);
+                    fputs(GLYPH_LOWER_HALF, game->fp_out);
+                }
+            }
+            game->term.cur_x += MINI_CELL_COLS;
+            game->prevMiniBuffer[k][j] = pair;
+            changes++;
+        }
+    }
+    return changes;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : pr_get
+ * 概要   : 4bit 詰めの行から列 j のセル値を取り出す
+ * --------------------------------------------------------------------------- */
+int pr_get(const PackedRow *r, int j) {
+    if (j < 8) return (r->hi >> (28 - 4 * j)) & 0xF;
+    return (r->lo >> (44 - 4 * j)) & 0xF;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : pr_pack
+ * 概要   : 1行分のセル値 (FIELD_WIDTH 個) を 4bit ずつ詰める
+ * --------------------------------------------------------------------------- */
+void pr_pack(PackedRow *r, const char *cells) {
+    unsigned int hi = 0;
+    unsigned short lo = 0;
+    int j;
+
+    for (j = 0; j < 8; j++) hi = (hi << 4) | (cells[j] & 0xF);
+    for (; j < FIELD_WIDTH; j++) lo = (unsigned short)((lo << 4) | (cells[j] & 0xF));
+    r->hi = hi;
+    r->lo = lo;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : pr_diff
+ * 概要   : 2つの行で値が異なる列を返す (bit j=列 j)
+ * 詳細   : 
+ * 32bit と 16bit の排他的論理和で行全体を比べ、一致していれば列を調べない。
+ * 異なる場合も、0 でないニブルだけを列のビットに変換する。
+ * --------------------------------------------------------------------------- */
+unsigned short pr_diff(const PackedRow *a, const PackedRow *b) {
+    unsigned int x = a->hi ^ b->hi;
+    unsigned short y = a->lo ^ b->lo;
+    unsigned short m = 0;
+    int j;
+
+    if (x) {
+        for (j = 0; j < 8; j++) if (x & (0xF0000000U >> (4 * j))) m |= 1U << j;
+    }
+    if (y) {
+        for (j = 0; j < 4; j++) if (y & (0xF000U >> (4 * j))) m |= 1U << (8 + j);
+    }
+    return m;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : pr_match
+ * 概要   : 2つの行で一致するセル数を数える
+ * --------------------------------------------------------------------------- */
+int pr_match(const PackedRow *a, const PackedRow *b) {
+    unsigned short m = pr_diff(a, b);
+    int n = FIELD_WIDTH;
+    for (; m; m &= m - 1) n--;
+    return n;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : scroll_field_view
+ * 概要   : 行単位のずれを検出し、端末側のスクロールで画面上の行を移動する
+ * 引数   : game  - 出力先のゲームインスタンス
+ * src   - 今回描画する内容 (displayBuffer)
+ * prev  - 前回描画した内容 (prevBuffer / prevOpponentBuffer)
+ * rows  - 差分描画する行 (入出力: スクロールした範囲の行を追加する)
+ * top_y - フィールド先頭行の画面Y座標
+ * left_x- フィールド左端の画面X座標
+ * 戻り値 : 送信したスクロール操作の回数
+ * 詳細   : 
+ * ライン消去 (下方向) とせり上がり (上方向) では、ほぼ全セルが prev と
+ * 異なるため、セル単位の差分描画では盤面全体を描き直すことになる。
+ * そこで、ずらし量 s ごとに「s行ずらした prev と一致するセル数」から
+ * 「そのままの prev と一致するセル数」を引いた利得を行毎に求め、
+ * 利得の和が最大となる連続行 (バンド) を探す。
+ * 空いた行で失われる一致分を差し引いた利得が SCROLL_MIN_GAIN 以上なら、
+ * DECSTBM (上下マージン) と DECSLRM (左右マージン) で対象フィールドだけを囲み、
+ * IL (ESC[nL) / DL (ESC[nM) で行を移動させ、prev にも同じ移動を適用する。
+ * 新たに現れた行は prev を無効値にし、続くセル差分で描画させる。
+ * 不連続な複数ラインの消去に対応するため、最大 SCROLL_MAX_PASSES 回繰り返す。
+ * 床の行 (最下段) は移動しないため対象外とする。
+ * --------------------------------------------------------------------------- */
+int scroll_field_view(TetrisGame *game, const PackedRow *src, PackedRow *prev,
+                      unsigned long *rows_mask, int top_y, int left_x) {
+    const int rows = FIELD_HEIGHT - 1;
+    int ops = 0;
+    int pass;
+
+    for (pass = 0; pass < SCROLL_MAX_PASSES; pass++) {
+        int r, s;
+        int diff_cells = 0;
+        int best_gain = 0, best_s = 0, best_a = 0, best_b = 0;
+
+        /* 変化が少なければ探索しない (ミノの移動程度ではスクロールしない) */
+        for (r = 0; r < rows; r++) {
+            if (*rows_mask & (1UL << r)) diff_cells += FIELD_WIDTH - pr_match(&src[r], &prev[r]);
+        }
+        if (diff_cells < SCROLL_MIN_GAIN) break;
+
+        for (s = -SCROLL_MAX_SHIFT; s <= SCROLL_MAX_SHIFT; s++) {
+            int sum = 0, a = 0;
+            if (s == 0) continue;
+            /* 行 r には旧 r-s 行の内容が来る (s>0:下へ, s<0:上へ) */
+            for (r = 0; r < rows; r++) {
+                int gain;
+                if (r - s < 0 || r - s >= rows) { sum = 0; a = r + 1; continue; }
+                gain = pr_match(&src[r], &prev[r - s]) - pr_match(&src[r], &prev[r]);
+                if (sum <= 0) { sum = 0; a = r; }
+                sum += gain;
+                if (sum > best_gain) { best_gain = sum; best_s = s; best_a = a; best_b = r; }
+            }
+        }
+        if (best_gain < SCROLL_MIN_GAIN) break;
+
+        {
+            int n = (best_s > 0) ? best_s : -best_s;
+            /* スクロール領域: 移動元と移動先を含む行範囲 */
+            int region_top = (best_s > 0) ? best_a - n : best_a;
+            int region_bottom = (best_s > 0) ? best_b : best_b + n;
+            int exposed_top = (best_s > 0) ? region_top : best_b + 1;
+
+            /* 空いた行で一致していたセルは描き直しになるので利得から引く */
+            for (r = exposed_top; r < exposed_top + n; r++) best_gain -= pr_match(&src[r], &prev[r]);
+            if (best_gain < SCROLL_MIN_GAIN) break;
+
+            fprintf(game->fp_out, ESC_LRMM_ON "\x1b[%d;%dr\x1b[%d;%ds\x1b[%d;%dH\x1b[%d%c"
+                    ESC_MARGIN_RESET ESC_LRMM_OFF,
+                    top_y + region_top, top_y + region_bottom,
+                    left_x, left_x + FIELD_WIDTH * 2 - 1,
+                    top_y + region_top, left_x,
+                    n, (best_s > 0) ? 'L' : 'M');
+            /* マージン解除でカーソルはホームへ戻る */
+            game->term.cur_y = 1; game->term.cur_x = 1;
+
+            /* prev にも同じ移動を適用し、空いた行は再描画対象にする */
+            if (best_s > 0) {
+                for (r = region_bottom; r >= region_top + n; r--) prev[r] = prev[r - n];
+                for (r = region_top; r < region_top + n; r++) memset(&prev[r], -1, sizeof(prev[r]));
+            } else {
+                for (r = region_top; r <= region_bottom - n; r++) prev[r] = prev[r + n];
+                for (r = region_bottom - n + 1; r <= region_bottom; r++) memset(&prev[r], -1, sizeof(prev[r]));
+            }
+            *rows_mask |= row_range_mask(region_top, region_bottom);
+            ops++;
+        }
+    }
+    return ops;
 }
 
 /* ---------------------------------------------------------------------------
@@ -257,112 +1099,567 @@ void print_cell_content(FILE *fp, char cellVal) {
  * 詳細   : 
  * 通信量を削減するため、前回の描画内容(prevBuffer)と比較し、
  * 変更があったセルのみカーソル移動して再描画を行う。
- * 対戦相手が接続されている場合は、右側に相手のフィールドも描画する。
+ * 比較するのはゲームロジックが印を付けた行 (dirty_rows) と、相手が
+ * 前回描画以降に更新した行 (row_stamp) だけで、変化のないフレームでは
+ * フィールドの比較を行わない。
+ * displayBuffer を作り直すときに前の内容と比べて、値が変わった列を行毎の
+ * 変化リスト (row_chg) にする。自分の画面はこのリストの列だけを描画し、
+ * 相手の画面も相手が作ったリストを列オフセットだけ変えて使う (差分は1回だけ取る)。
+ * リストが使えない行 (バッファ無効化・スクロール後・前回の取り込みから
+ * 2回以上変化した相手の行) は、4bit 詰めの行どうしを語単位で比べて列を求める。
+ * 相手の画面は相手が公開したスナップショット (snap_seq で保護) の写しから
+ * 描画し、更新途中の displayBuffer を直接読むことはない。
+ * 行全体がずれた場合は、先に端末側のスクロールで行を移動させる。
+ * 攻撃先 (target) のプレイヤーがいる場合は、右側にその相手のフィールドだけを描画する
+ * (人数が増えても1ポートの送信量は2人対戦と変わらない)。
+ * 表示する相手が替わった場合は相手画面を描き直す。
+ * ヘッダ行も前回送信した値と比較し、変化があった場合のみ描き直す。
  * --------------------------------------------------------------------------- */
 void display(TetrisGame *game) {
     int i, j;
     int changes = 0;
+    unsigned short cols[FIELD_HEIGHT]; /* 今回 displayBuffer で値が変わった列 (自分の画面用) */
     
-    int opponent_id = (game->port_id == 0) ? 1 : 0;
-    TetrisGame *opponent = all_games[opponent_id];
+    int opp_id = game->target;
+    TetrisGame *opponent = (opp_id >= 0) ? all_games[opp_id] : NULL;
 
-    /* 相手接続検知時のバッファリセット (初期化漏れ防止) */
+    /* 相手の接続・表示する相手の交代を検知したらバッファをリセット */
     int opponent_connected = (opponent != NULL);
-    if (opponent_connected && !game->opponent_was_connected) {
+    if (!opponent_connected) opp_id = -1;
+    if (opponent_connected && opp_id != game->opp_view_id) {
         memset(game->prevOpponentBuffer, -1, sizeof(game->prevOpponentBuffer));
+        memset(game->prevMiniBuffer, 0xFF, sizeof(game->prevMiniBuffer));
+        memset(game->oppSnapshot, CELL_EMPTY, sizeof(game->oppSnapshot));
+        game->opp_force_rows = ALL_ROWS_MASK;
+        game->opp_seen_frame = 0;
+        game->opp_snap_seq = 1;
     }
-    game->opponent_was_connected = opponent_connected;
+    game->opp_view_id = opp_id;
 
     /* [Step 1] 描画バッファ構築 (現在のフィールド + 操作中ミノ + ゴースト) */
-    memcpy(game->displayBuffer, game->field, sizeof(game->field));
-
-    /* ゴースト描画 (落下地点の予測) */
-    if (game->minoType != MINO_TYPE_GARBAGE) {
-        int ghostY = game->minoY;
-        /* 接地するまでY座標を下げる */
-        while (!isHit(game, game->minoX, ghostY + 1, game->minoType, game->minoAngle)) {
-            ghostY++;
-        }
-        /* ゴーストをバッファに書き込み */
-        for (i = 0; i < MINO_HEIGHT; i++) {
-            for (j = 0; j < MINO_WIDTH; j++) {
-                if (minoShapes[game->minoType][game->minoAngle][i][j]) {
-                    if (ghostY + i >= 0 && ghostY + i < FIELD_HEIGHT &&
-                        game->minoX + j >= 0 && game->minoX + j < FIELD_WIDTH) {
-                        if (game->displayBuffer[ghostY + i][game->minoX + j] == CELL_EMPTY) {
-                            game->displayBuffer[ghostY + i][game->minoX + j] = CELL_GHOST;
-                        }
-                    }
-                }
+    /* ミノが動いた場合は、移動前と移動後の占有行を作り直す */
+    if (game->piece_dirty) {
+        unsigned long rows = 0;
+        if (game->minoType != MINO_TYPE_GARBAGE) {
+            int ghostY = game->minoY;
+            /* 接地するまでY座標を下げる (落下地点の予測) */
+            while (!isHit(game, game->minoX, ghostY + 1, game->minoType, game->minoAngle)) {
+                ghostY++;
             }
+            game->ghostY = ghostY;
+            rows = row_range_mask(game->minoY, game->minoY + MINO_HEIGHT - 1) |
+                   row_range_mask(ghostY, ghostY + MINO_HEIGHT - 1);
         }
+        game->dirty_rows |= game->piece_rows | rows;
+        game->piece_rows = rows;
+        game->piece_dirty = 0;
     }
 
-    /* 操作中ミノの描画 */
-    for (i = 0; i < MINO_HEIGHT; i++) {
-        for (j = 0; j < MINO_WIDTH; j++) {
-            if (game->minoType != MINO_TYPE_GARBAGE && 
-                minoShapes[game->minoType][game->minoAngle][i][j]) {
-                if (game->minoY + i >= 0 && game->minoY + i < FIELD_HEIGHT &&
-                    game->minoX + j >= 0 && game->minoX + j < FIELD_WIDTH) {
-                    game->displayBuffer[game->minoY + i][game->minoX + j] = 2 + game->minoType;
+    /* 相手に見せる内容を書き換える間は snap_seq を奇数にしておく */
+    int publish = game->dirty_rows || game->pub_score != game->score ||
+                  game->pub_lines != game->lines_cleared;
+    if (publish) {
+        game->snap_seq++;
+        SNAP_BARRIER();
+    }
+
+    memset(cols, 0, sizeof(cols));
+    if (game->dirty_rows) {
+        unsigned long frame = game->frame_no + 1;
+
+        for (i = 0; i < FIELD_HEIGHT; i++) {
+            char row[FIELD_WIDTH];
+            PackedRow packed;
+            unsigned short m;
+            int my = i - game->minoY, gy = i - game->ghostY;
+
+            if (!(game->dirty_rows & (1UL << i))) continue;
+            memcpy(row, game->field[i], FIELD_WIDTH);
+            if (game->minoType != MINO_TYPE_GARBAGE) {
+                for (j = 0; j < MINO_WIDTH; j++) {
+                    int x = game->minoX + j;
+                    if (x < 0 || x >= FIELD_WIDTH) continue;
+                    /* ゴースト (空きセルのみ) の上に操作中ミノを重ねる */
+                    if (gy >= 0 && gy < MINO_HEIGHT && minoShapes[game->minoType][game->minoAngle][gy][j] &&
+                        row[x] == CELL_EMPTY) {
+                        row[x] = CELL_GHOST;
+                    }
+                    if (my >= 0 && my < MINO_HEIGHT && minoShapes[game->minoType][game->minoAngle][my][j]) {
+                        row[x] = 2 + game->minoType;
+                    }
                 }
             }
+            /* 変化リスト: 前の内容と値が異なる列 */
+            pr_pack(&packed, row);
+            m = pr_diff(&packed, &game->displayBuffer[i]);
+            cols[i] = m;
+            if (m) {
+                game->displayBuffer[i] = packed;
+                game->row_chg_base[i] = game->row_stamp[i];
+                game->row_chg[i] = m;
+                game->row_stamp[i] = frame;
+            }
         }
+        /* 行の書き換えを終えてから番号を進める (相手は番号を見て読み取る) */
+        game->frame_no = frame;
     }
 
-    /* [Step 2] ヘッダ情報描画 (スコア等) */
-    fprintf(game->fp_out, "\x1b[1;1H"); 
-    fprintf(game->fp_out, "[YOU] SC:%-5d x%d ATK:%d", 
-            game->score, g_score_multiplier, game->pending_garbage);
-    
-    if (opponent != NULL) {
-        fprintf(game->fp_out, "\x1b[1;%dH", OPPONENT_OFFSET_X);
-        fprintf(game->fp_out, "[RIVAL] SC:%-5d LN:%-3d", 
-                opponent->score, opponent->lines_cleared);
-    } else {
-        fprintf(game->fp_out, "\x1b[1;%dH", OPPONENT_OFFSET_X);
-        fprintf(game->fp_out, "[RIVAL] (Waiting...)    ");
+    if (publish) {
+        game->pub_score = game->score;
+        game->pub_lines = game->lines_cleared;
+        SNAP_BARRIER();
+        game->snap_seq++;
+    }
+
+    /* [Step 2] 相手の公開スナップショットの取り込み */
+    /* 版が変わっていなければ相手画面の比較は行わない */
+    unsigned long opp_rows = 0;
+    int snap = SNAP_SAME;
+    if (opponent_connected) {
+        snap = read_opponent_snapshot(game, opponent, &opp_rows);
+        if (snap != SNAP_BUSY) opp_rows |= game->opp_force_rows;
     }
-    fprintf(game->fp_out, "%s", ESC_CLR_LINE);
 
-    fprintf(game->fp_out, "\n--------------------------");
-    if (opponent != NULL) {
-        fprintf(game->fp_out, "\x1b[2;%dH", OPPONENT_OFFSET_X);
-        fprintf(game->fp_out, "--------------------------");
+    /* [Step 3] ヘッダ情報描画 (スコア等) */
+    /* 前回送信した値から変化した部分だけを描き直す */
+    {
+        HeaderCache *h = &game->hdr;
+        int garbage = garbage_pending(game);
+        int opp_score = opponent_connected ? game->opp_score : 0;
+        int opp_lines = opponent_connected ? game->opp_lines : 0;
+        int own_changed = !h->valid || h->score != game->score ||
+                          h->multiplier != g_score_multiplier || h->garbage != garbage;
+        int sep_changed = !h->valid || (h->opp_id >= 0) != opponent_connected;
+        int opp_changed = sep_changed || h->opp_id != opp_id ||
+                          h->opp_score != opp_score || h->opp_lines != opp_lines;
+
+        if (own_changed || opp_changed) term_reset_attr(game);
+        if (own_changed) {
+            fprintf(game->fp_out, "\x1b[1;1H[YOU] SC:%-5d x%d ATK:%-3d", 
+                    game->score, g_score_multiplier, garbage);
+        }
+        if (opp_changed) {
+            fprintf(game->fp_out, "\x1b[1;%dH", OPPONENT_OFFSET_X);
+            if (opponent_connected) {
+                fprintf(game->fp_out, "[RIVAL P%d] SC:%-5d LN:%-3d", opp_id + 1, opp_score, opp_lines);
+            } else {
+                fprintf(game->fp_out, "[RIVAL] (Waiting...)    ");
+            }
+            fprintf(game->fp_out, "%s", ESC_CLR_LINE);
+        }
+        if (sep_changed) {
+            fprintf(game->fp_out, "\x1b[2;1H--------------------------");
+            if (opponent_connected) {
+                fprintf(game->fp_out, "\x1b[2;%dH", OPPONENT_OFFSET_X);
+                fprintf(game->fp_out, "--------------------------");
+            }
+            fprintf(game->fp_out, "%s", ESC_CLR_LINE);
+        }
+        if (own_changed || opp_changed) {
+            /* ヘッダ出力後のカーソル位置はトラッカ管理外 */
+            game->term.cur_y = 0;
+            changes++;
+        }
+
+        h->valid = 1;
+        h->score = game->score; h->multiplier = g_score_multiplier; h->garbage = garbage;
+        h->opp_id = opp_id; h->opp_score = opp_score; h->opp_lines = opp_lines;
     }
-    fprintf(game->fp_out, "%s", ESC_CLR_LINE);
 
-    /* [Step 3] フィールドの差分描画 */
+    /* [Step 4] フィールドの差分描画 (カーソル移動・色指定は差分のみ送信) */
     int base_y = 3;
+    unsigned long my_rows = game->dirty_rows | game->own_force_rows;
+    unsigned long my_full = game->own_force_rows; /* 変化リストを使わず行全体を比較する行 */
+    unsigned long opp_full = (snap != SNAP_BUSY) ? game->opp_force_rows : 0;
+
+    /* 左右マージンのない端末では行挿入・削除が画面の全幅をずらすので、設定したポートだけ */
+    if (game->scroll_accel && my_rows) {
+        int ops = scroll_field_view(game, game->displayBuffer, game->prevBuffer,
+                                    &my_rows, base_y, 1);
+        if (ops) my_full = my_rows; /* prevBuffer の行がずれたので行全体を比較 */
+        changes += ops;
+    }
+    if (game->scroll_accel && opp_rows && game->rival_view == RIVAL_VIEW_FULL) {
+        int ops = scroll_field_view(game, game->oppSnapshot, game->prevOpponentBuffer,
+                                    &opp_rows, base_y, OPPONENT_OFFSET_X);
+        if (ops) opp_full = opp_rows;
+        changes += ops;
+    }
+    /* 縮小表示では相手画面を別に描画する */
+    if (opp_rows && game->rival_view == RIVAL_VIEW_COMPACT) {
+        changes += draw_rival_compact(game, game->oppSnapshot, opp_rows, base_y);
+        opp_rows = 0;
+    }
+    /* 変化リストの列は前回描画した内容と必ず異なるので、列毎の比較はしない */
     for (i = 0; i < FIELD_HEIGHT; i++) {
-        /* 自分自身のフィールド */
-        for (j = 0; j < FIELD_WIDTH; j++) {
-            char myVal = game->displayBuffer[i][j];
-            if (myVal != game->prevBuffer[i][j]) {
-                fprintf(game->fp_out, "\x1b[%d;%dH", base_y + i, j * 2 + 1);
-                print_cell_content(game->fp_out, myVal);
-                game->prevBuffer[i][j] = myVal;
+        unsigned short m;
+        if (!((my_rows | opp_rows) & (1UL << i))) continue;
+        /* 自分自身のフィールド (変化リストの列だけ) */
+        if (my_rows & (1UL << i)) {
+            m = (my_full & (1UL << i)) ? pr_diff(&game->displayBuffer[i], &game->prevBuffer[i]) : cols[i];
+            for (j = 0; m; j++, m >>= 1) {
+                if (!(m & 1)) continue;
+                term_goto(game, base_y + i, j * 2 + 1);
+                print_cell_content(game, pr_get(&game->displayBuffer[i], j));
                 changes++;
             }
+            game->prevBuffer[i] = game->displayBuffer[i];
         }
-        /* 対戦相手のフィールド (接続時のみ) */
-        if (opponent != NULL) {
-            for (j = 0; j < FIELD_WIDTH; j++) {
-                char oppVal = opponent->displayBuffer[i][j];
-                if (oppVal != game->prevOpponentBuffer[i][j]) {
-                    fprintf(game->fp_out, "\x1b[%d;%dH", base_y + i, OPPONENT_OFFSET_X + j * 2);
-                    print_cell_content(game->fp_out, oppVal);
-                    game->prevOpponentBuffer[i][j] = oppVal;
-                    changes++;
-                }
+        /* 対戦相手のフィールド (接続時のみ. 相手の変化リストの列だけ) */
+        if (opp_rows & (1UL << i)) {
+            m = (opp_full & (1UL << i)) ? pr_diff(&game->oppSnapshot[i], &game->prevOpponentBuffer[i]) :
+                                          game->opp_chg[i];
+            for (j = 0; m; j++, m >>= 1) {
+                if (!(m & 1)) continue;
+                term_goto(game, base_y + i, OPPONENT_OFFSET_X + j * 2);
+                print_cell_content(game, pr_get(&game->oppSnapshot[i], j));
+                changes++;
             }
+            game->prevOpponentBuffer[i] = game->oppSnapshot[i];
         }
     }
+    game->dirty_rows = 0;
+    game->own_force_rows = 0;
+    if (snap != SNAP_BUSY) game->opp_force_rows = 0;
+
     /* 変更があった場合のみバッファをフラッシュ */
     if (changes > 0) fflush(game->fp_out);
 }
 
+/* ---------------------------------------------------------------------------
+ * 関数名 : read_opponent_snapshot
+ * 概要   : 相手が公開したスナップショットを読み取り側のコピーに取り込む
+ * 引数   : game     - 読み取り側のゲームインスタンス
+ * opponent - 相手
+ * rows     - 取り込んだ (更新のあった) 行を OR する
+ * 戻り値 : SNAP_SAME / SNAP_NEW / SNAP_BUSY
+ * 詳細   : 
+ * 相手の snap_seq が前回と同じなら何もしない。
+ * 奇数 (相手が書き換え中にプリエンプトされた) の場合は、相手が進むまで
+ * 結果が変わらないため、取り込まずに次のフレームで再試行する。
+ * コピーの前後で snap_seq が一致しなければ、途中で書き換えられたものとして
+ * 読み直す (前回描画以降に更新された行だけをコピーする)。
+ * --------------------------------------------------------------------------- */
+int read_opponent_snapshot(TetrisGame *game, TetrisGame *opponent, unsigned long *rows) {
+    int i, retry;
+
+    for (retry = 0; retry < SNAP_READ_RETRY; retry++) {
+        unsigned long seq = opponent->snap_seq;
+        unsigned long frame, changed = 0;
+        int score, lines;
+
+        if (seq == game->opp_snap_seq) return SNAP_SAME;
+        if (seq & 1) break;
+        SNAP_BARRIER();
+
+        frame = opponent->frame_no;
+        for (i = 0; i < FIELD_HEIGHT; i++) {
+            if (opponent->row_stamp[i] > game->opp_seen_frame) {
+                game->oppSnapshot[i] = opponent->displayBuffer[i];
+                /* 前回の取り込み以降の変化が1回だけなら相手の変化リストがそのまま使える.
+                   2回以上なら前回描画した行と語単位で比べ直す */
+                game->opp_chg[i] = (opponent->row_chg_base[i] <= game->opp_seen_frame) ?
+                                   opponent->row_chg[i] :
+                                   pr_diff(&game->oppSnapshot[i], &game->prevOpponentBuffer[i]);
+                changed |= 1UL << i;
+            }
+        }
+        score = opponent->pub_score;
+        lines = opponent->pub_lines;
+
+        SNAP_BARRIER();
+        if (opponent->snap_seq == seq) {
+            game->opp_snap_seq = seq;
+            game->opp_seen_frame = frame;
+            game->opp_score = score;
+            game->opp_lines = lines;
+            *rows |= changed;
+            return SNAP_NEW;
+        }
+    }
+    /* 相手の書き換え完了後に取り込み直す */
+    request_display(game);
+    return SNAP_BUSY;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : request_display
+ * 概要   : 描画要求 (次のフレームでまとめて描画する)
+ * 詳細   : 
+ * 状態を変えた処理はここで印を付けるだけにし、実際の描画は wait_event が
+ * フレーム間隔に達した時点で present_frame を呼んで行う。
+ * 間隔内に複数回要求されても描画は1回で、常に最新の状態が送られる。
+ * --------------------------------------------------------------------------- */
+void request_display(TetrisGame *game) {
+    game->frame_pending = 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : present_frame
+ * 概要   : 1フレームを描画し、次のフレーム時刻を決める
+ * 詳細   : 
+ * 描画中に送信したバイト数 (port_tx_bytes) と経過時間 (mtk_now_cycles) から
+ * ポートの送信レートを実測し、移動平均で保持する (tick は周期動作では skipmt でも
+ * 進むので使わない)。経過が1カウント未満なら1カウントとみなす (outbyte が
+ * 待たされない = 回線が詰まっていない)。次のフレームは「今回のバイト数を送るのに
+ * かかる時間」だけ空けてから描画する (送信が回線時間の半分を超えない)。
+ * ただし FRAME_MAX_FPS を超える頻度では描画しない。
+ * --------------------------------------------------------------------------- */
+void present_frame(TetrisGame *game) {
+    unsigned long start = mtk_now_cycles();
+    unsigned long start_bytes = port_tx_bytes[game->port_id];
+    unsigned long bytes, now, elapsed, interval;
+
+    game->frame_pending = 0;
+    spec_resync(game);
+    MTK_PROFILE_SCOPE(display) {
+        display(game);
+    }
+    MTK_TRACE_MARK(game->port_id); /* フレームを送り出した (印の番号 = ポート) */
+    FRAME_MARK(game->port_id);
+    latency_record(game);
+
+    bytes = port_tx_bytes[game->port_id] - start_bytes;
+    now = mtk_now_cycles();
+    elapsed = now - start;
+    if (elapsed == 0) elapsed = 1;
+    if (bytes > 0) {
+        unsigned long rate = (bytes << TX_RATE_SHIFT) / elapsed;
+        game->tx_rate = (game->tx_rate == 0) ? rate : (game->tx_rate * 3 + rate) / 4;
+    }
+
+    interval = FRAME_MIN_INTERVAL;
+    if (game->tx_rate > 0 && (bytes << TX_RATE_SHIFT) / game->tx_rate > interval) {
+        interval = (bytes << TX_RATE_SHIFT) / game->tx_rate;
+    }
+    game->next_frame = now + interval;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : latency_record
+ * 概要   : 入力からフレーム送出完了までの遅延をヒストグラムに加える
+ * 詳細   : 
+ * present_frame の display() (fflush まで) の直後に呼ぶ。
+ * 前のフレーム以降に受け取った最初の入力の時刻 (inbyte がその最初のバイトを
+ * 返した時刻) から、最後のバイトを outbyte に渡し終えた時刻までを
+ * mtk_now_cycles で測る (モニタの受信キュー・送信キューに残っていた時間は
+ * 含まない)。区間 k は 2^(k-1) 〜 2^k - 1 ms (k=0 は 1ms 未満)。
+ * --------------------------------------------------------------------------- */
+void latency_record(TetrisGame *game) {
+    unsigned long lat, ms;
+    int k = 0;
+
+    if (!game->input_pending) return;
+    game->input_pending = 0;
+    lat = mtk_now_cycles() - game->input_cycles;
+    ms = lat / LAT_COUNTS_PER_MS;
+    while (k < LAT_BUCKETS - 1 && (ms >> k) != 0) k++;
+    game->lat_hist[k]++;
+    game->lat_count++;
+    game->lat_sum += lat;
+    if (lat > game->lat_max) game->lat_max = lat;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : show_latency
+ * 概要   : 入力遅延のヒストグラムを表示する (結果画面・Quit 後)
+ * --------------------------------------------------------------------------- */
+void show_latency(TetrisGame *game) {
+    unsigned long peak = 0, avg, max;
+    int k, first = -1, last = -1;
+
+    if (game->lat_count == 0) return;
+    for (k = 0; k < LAT_BUCKETS; k++) {
+        if (game->lat_hist[k] == 0) continue;
+        if (first < 0) first = k;
+        last = k;
+        if (game->lat_hist[k] > peak) peak = game->lat_hist[k];
+    }
+    avg = game->lat_sum * 10 / LAT_COUNTS_PER_MS / game->lat_count; /* 0.1ms 単位 */
+    max = game->lat_max * 10 / LAT_COUNTS_PER_MS;
+    fprintf(game->fp_out, "\nInput latency [ms]: n=%lu avg %lu.%lu max %lu.%lu\n",
+            game->lat_count, avg / 10, avg % 10, max / 10, max % 10);
+    for (k = first; k <= last; k++) {
+        unsigned long lo = k ? 1UL << (k - 1) : 0;
+        int bar = (int)((game->lat_hist[k] * LAT_BAR_MAX + peak - 1) / peak);
+        if (k == LAT_BUCKETS - 1)   fprintf(game->fp_out, "%4lu+    |", lo);
+        else if (lo + 1 >= 1UL << k) fprintf(game->fp_out, "%4lu     |", lo);
+        else                        fprintf(game->fp_out, "%4lu-%-4lu|", lo, (1UL << k) - 1);
+        while (bar-- > 0) fputc('#', game->fp_out);
+        fprintf(game->fp_out, " %lu\n", game->lat_hist[k]);
+    }
+}
+
+#if NUM_SPECTATORS > 0
+/* ---------------------------------------------------------------------------
+ * 関数名 : spec_tap
+ * 概要   : プレイヤーのポートへ送るデータを配信リングに写す
+ * 引数   : ch     - ポート番号 (= プレイヤー番号)
+ * buf    - write() に渡されたデータ (改行変換前)
+ * nbytes - バイト数
+ * 詳細   : 
+ * csys68k.c の write() から port_tap 経由で、プレイヤーのタスク上で呼ばれる。
+ * display() が組み立てたバイト列をそのまま写すので、観戦ポートが何個あっても
+ * 描画 (差分の比較とエスケープシーケンスの組み立て) は1回で済む。
+ * 観戦者がいなければ何もしない。
+ * 読み手がコピー中の領域を上書きしたか判定できるよう、先に reserve を進めてから
+ * 書き込み、最後に head を進める。
+ * --------------------------------------------------------------------------- */
+void spec_tap(int ch, const char *buf, int nbytes) {
+    SpecFeed *feed = &spec_feeds[ch];
+    unsigned long head = feed->head;
+
+    if (feed->subscribers == 0) return;
+    if (nbytes > SPEC_RING_SIZE) {
+        /* リングより長い書き込みは末尾だけ残す (読み手は取りこぼしとして扱う) */
+        buf += nbytes - SPEC_RING_SIZE;
+        head += nbytes - SPEC_RING_SIZE;
+        nbytes = SPEC_RING_SIZE;
+    }
+    feed->reserve = head + nbytes;
+    SNAP_BARRIER();
+    while (nbytes > 0) {
+        int off = (int)(head % SPEC_RING_SIZE);
+        int n = SPEC_RING_SIZE - off;
+        if (n > nbytes) n = nbytes;
+        memcpy(&feed->buf[off], buf, n);
+        buf += n; head += n; nbytes -= n;
+    }
+    SNAP_BARRIER();
+    feed->head = head;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : spec_keyframe
+ * 概要   : 次に送る画面クリアからをキーフレームとして観戦側に知らせる
+ * 詳細   : 
+ * ESC_CLS で始まる画面 (開始画面・試合開始・結果表示・再同期) の直前に呼ぶ。
+ * キーフレームを待っている観戦ポートは、この位置から送り始める。
+ * --------------------------------------------------------------------------- */
+void spec_keyframe(TetrisGame *game) {
+    SpecFeed *feed = &spec_feeds[game->port_id];
+
+    fflush(game->fp_out); /* それまでの出力はキーフレームより前に置く */
+    feed->key = feed->head;
+    SNAP_BARRIER();
+    feed->key_seq++;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : spec_resync
+ * 概要   : 観戦側の要求に応じて全画面を描き直す (present_frame から呼ぶ)
+ * 詳細   : 
+ * 途中から加わった観戦ポートや、リングを取りこぼした観戦ポートは差分の
+ * 基準になる画面を持たないため、キーフレームとして全画面を送る。
+ * 同じ全画面がプレイヤー自身のポートにも送られる (見た目は変わらない)。
+ * 試合中以外 (開始画面・結果画面) の要求は、次の画面クリアで満たされる。
+ * --------------------------------------------------------------------------- */
+void spec_resync(TetrisGame *game) {
+    SpecFeed *feed = &spec_feeds[game->port_id];
+
+    if (!feed->resync) return;
+    feed->resync = 0;
+    spec_keyframe(game);
+    fprintf(game->fp_out, ESC_CLS ESC_HIDE_CUR);
+    memset(game->prevBuffer, -1, sizeof(game->prevBuffer));
+    memset(game->prevOpponentBuffer, -1, sizeof(game->prevOpponentBuffer));
+    memset(game->prevMiniBuffer, 0xFF, sizeof(game->prevMiniBuffer));
+    game->own_force_rows = game->opp_force_rows = ALL_ROWS_MASK;
+    mark_field_rows(game, 0, FIELD_HEIGHT - 1);
+    term_invalidate(game);
+    game->hdr.valid = 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : spec_banner
+ * 概要   : 観戦ポートの案内を表示する
+ * --------------------------------------------------------------------------- */
+void spec_banner(Spectator *sp) {
+    fprintf(sp->fp, ESC_CLS ESC_HOME ESC_RESET ESC_SHOW_CUR);
+    fprintf(sp->fp, "============================\n");
+    fprintf(sp->fp, "   TETRIS: SPECTATOR PORT%d  \n", sp->port);
+    fprintf(sp->fp, "============================\n");
+    fprintf(sp->fp, "\nPress 1-%d to watch a player, 0 to stop.\n", NUM_PLAYERS);
+    fflush(sp->fp);
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : spec_watch
+ * 概要   : 観戦するプレイヤーを切り替える
+ * 引数   : sp     - 観戦ポート
+ * player - 観戦するプレイヤー (-1=観戦をやめる)
+ * 詳細   : 
+ * 観戦者として数えてから (以降の送信はリングに写される) key_seq を控え、
+ * キーフレームを要求する。それより後のキーフレームから送り始める。
+ * --------------------------------------------------------------------------- */
+void spec_watch(Spectator *sp, int player) {
+    if (sp->player >= 0) spec_feeds[sp->player].subscribers--;
+    sp->player = player;
+    if (player < 0) {
+        spec_banner(sp);
+        return;
+    }
+    spec_feeds[player].subscribers++;
+    SNAP_BARRIER();
+    sp->key_seen = spec_feeds[player].key_seq;
+    sp->waiting_key = 1;
+    spec_feeds[player].resync = 1;
+    fprintf(sp->fp, "\r" ESC_CLR_LINE "Waiting for Player %d...", player + 1);
+    fflush(sp->fp);
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : spec_pump
+ * 概要   : 観戦ポート1つ分の処理 (キー入力と配信リングからの送信)
+ * 戻り値 : 送信したバイト数
+ * 詳細   : 
+ * キーフレーム待ちの間は送らない。送る前に上書きされた (SPEC_RING_SIZE 以上
+ * 遅れた) 場合は、キーフレームを要求して待ち直す。
+ * 1回に送るのは SPEC_CHUNK バイトまで (他の観戦ポートと交互に送る)。
+ * --------------------------------------------------------------------------- */
+int spec_pump(Spectator *sp) {
+    unsigned char chunk[SPEC_CHUNK];
+    SpecFeed *feed;
+    unsigned long avail;
+    int c, n, off, first;
+
+    c = inbyte(sp->port);
+    if (c >= '1' && c < '1' + NUM_PLAYERS) spec_watch(sp, c - '1');
+    else if (c == '0' || c == 'q') spec_watch(sp, -1);
+    if (sp->player < 0) return 0;
+
+    feed = &spec_feeds[sp->player];
+    if (sp->waiting_key) {
+        if (feed->key_seq == sp->key_seen) return 0;
+        SNAP_BARRIER();
+        sp->pos = feed->key;
+        sp->waiting_key = 0;
+    }
+    avail = feed->head - sp->pos;
+    if (avail == 0) return 0;
+    n = (avail > SPEC_CHUNK) ? SPEC_CHUNK : (int)avail;
+    SNAP_BARRIER();
+
+    off = (int)(sp->pos % SPEC_RING_SIZE);
+    first = (off + n > SPEC_RING_SIZE) ? SPEC_RING_SIZE - off : n;
+    memcpy(chunk, &feed->buf[off], first);
+    memcpy(chunk + first, feed->buf, n - first);
+
+    SNAP_BARRIER();
+    if (feed->reserve - sp->pos > SPEC_RING_SIZE) {
+        /* 送る前に上書きされた: 全画面から送り直す */
+        sp->key_seen = feed->key_seq;
+        sp->waiting_key = 1;
+        feed->resync = 1;
+        return 0;
+    }
+    fwrite(chunk, 1, n, sp->fp);
+    fflush(sp->fp);
+    sp->pos += n;
+    return n;
+}
+#endif
+
 /* ---------------------------------------------------------------------------
  * 関数名 : perform_countdown
  * 概要   : ゲーム開始前のカウントダウン演出 (3, 2, 1, GO!)
@@ -376,16 +1673,19 @@ void perform_countdown(TetrisGame *game) {
 
     for (i = 0; i < 4; i++) {
         fprintf(game->fp_out, "\x1b[%d;%dH%s%s   %s   %s", 
-                base_y, base_x - 1, BG_BLACK, COL_YELLOW, messages[i], ESC_RESET);
+                base_y, base_x - 1, BG_BLACK, paletteSeq[game->color_profile][PAL_YELLOW],
+                messages[i], ESC_RESET);
         fflush(game->fp_out);
         if (i == 3) break;
         
         /* 待機 (定数 COUNTDOWN_DELAY 使用) */
-        unsigned long target_tick = tick + COUNTDOWN_DELAY;
-        while (tick < target_tick) skipmt();
+        sleep_until(tick + COUNTDOWN_DELAY);
     }
     /* 描画クリアのために前回のバッファ内容を無効化 */
     memset(game->prevBuffer, -1, sizeof(game->prevBuffer));
+    game->own_force_rows = ALL_ROWS_MASK;
+    mark_field_rows(game, 0, FIELD_HEIGHT - 1);
+    term_invalidate(game);
 }
 
 /* ***************************************************************************
@@ -394,28 +1694,69 @@ void perform_countdown(TetrisGame *game) {
 
 /* ---------------------------------------------------------------------------
  * 関数名 : wait_event
+ * 概要   : イベント待機 (通常は入力から、再生時は記録から取り出す)
+ * 戻り値 : 発生したイベント構造体
+ * 詳細   : 
+ * 通常時は返すイベントを全て入力記録に追加する。
+ * --------------------------------------------------------------------------- */
+Event wait_event(TetrisGame *game) {
+    Event e;
+    if (game->replay) return replay_event(game);
+    e = read_event(game);
+    log_append(game, e.type, (e.type == EVT_KEY_INPUT) ? e.param : 0);
+    if (e.type == EVT_KEY_INPUT && !game->input_pending) {
+        /* 遅延計測: 次に送り出すフレームまでの時間を測る (時刻は read_event が記録) */
+        game->input_pending = 1;
+    }
+    return e;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : idle_poll
+ * 概要   : 入力待ちの間の描画処理
+ * 戻り値 : 1=定期描画の要求を出した
+ * 詳細   : 
+ * 描画はフレーム時刻に達していれば行う (present_frame)。
+ * 相手の動きを反映するため、DISPLAY_POLL_INTERVAL 毎に描画を要求する。
+ * --------------------------------------------------------------------------- */
+int idle_poll(TetrisGame *game) {
+    if (game->frame_pending && (long)(mtk_now_cycles() - game->next_frame) >= 0) {
+        present_frame(game);
+    }
+    if (tick >= game->next_poll_tick) {
+        request_display(game);
+        game->next_poll_tick = tick + DISPLAY_POLL_INTERVAL;
+        return 1;
+    }
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : read_event
  * 概要   : イベント待機ループ (ノンブロッキング入力)
  * 戻り値 : 発生したイベント構造体
  * 詳細   : 
  * キー入力、タイマ発火、勝利判定などを監視する。
  * 入力がない間は skipmt() を呼び出し、CPU権を他タスクに譲る。
+ * 描画は入力を処理し切った後に行う。
  * --------------------------------------------------------------------------- */
-Event wait_event(TetrisGame *game) {
+Event read_event(TetrisGame *game) {
     Event e;
     e.type = EVT_NONE;
     int c;
-    int opponent_id = (game->port_id == 0) ? 1 : 0;
-    static int poll_counter = 0;
 
     while (1) {
-        /* 1. 勝利判定 (相手がゲームオーバーになったか) */
-        if (all_games[opponent_id] != NULL && all_games[opponent_id]->is_gameover) {
+        /* 1. 勝利判定 (攻撃先が脱落したら次の相手へ. 生存者がいなければ勝利) */
+        if (current_target(game) == NULL && game->target >= 0) {
             e.type = EVT_WIN; return e;
         }
 
-        /* 2. 入力チェック (ノンブロッキング) */
+        /* 2. 入力チェック (ノンブロッキング. キー入力がなければボットの操作) */
         c = inbyte(game->port_id);
+        if (c == -1 && game->bot_aps) c = bot_input(game);
         if (c != -1) {
+            /* 遅延計測: キーの最初のバイトを受け取った時刻 (フレームに反映するまで更新しない) */
+            if (game->seq_state == 0 && !game->input_pending) game->input_cycles = mtk_now_cycles();
             /* エスケープシーケンス解析 (矢印キー対応) */
             if (game->seq_state == 0) {
                 if (c == 0x1b) game->seq_state = 1;      /* ESC受信 */
@@ -443,10 +1784,8 @@ Event wait_event(TetrisGame *game) {
             if (tick >= game->next_drop_time) {
                 e.type = EVT_TIMER; return e;
             }
-            /* 4. アイドル時の定期描画更新 (相手の動きを反映するため) */
-            poll_counter++;
-            if (poll_counter >= DISPLAY_POLL_INTERVAL) {
-                display(game); poll_counter = 0;
+            /* 4. 描画と定期描画要求 */
+            if (idle_poll(game)) {
                 /* アニメーション中はイベントとして返さず継続 */
                 if (game->state == GS_ANIMATING) { e.type = EVT_NONE; return e; }
             }
@@ -456,6 +1795,81 @@ Event wait_event(TetrisGame *game) {
     }
 }
 
+/* ---------------------------------------------------------------------------
+ * 関数名 : log_begin
+ * 概要   : ゲーム開始時の記録・再生の準備 (カウントダウン後に呼ぶ)
+ * 詳細   : 
+ * 記録する場合は前の試合の記録を捨てて、合意した種を保存する。
+ * 以降の経過tickはこの時点を基準とする。
+ * --------------------------------------------------------------------------- */
+void log_begin(TetrisGame *game) {
+    ReplayLog *log = &replay_logs[game->port_id];
+
+    if (!game->replay) {
+        log->seed = game->match_seed;
+        log->count = 0;
+        log->truncated = 0;
+    }
+    game->replay_pos = 0;
+    game->log_tick = tick;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : log_append
+ * 概要   : 入力記録に1件追加する (再生中は何もしない)
+ * 詳細   : 
+ * 経過tickは前の記録からの差分で持つ (16bitに収まらない分は切り詰める)。
+ * 上限に達したら以降は記録しない。その記録は途中で再生が終わる。
+ * --------------------------------------------------------------------------- */
+void log_append(TetrisGame *game, int type, int param) {
+    ReplayLog *log = &replay_logs[game->port_id];
+    unsigned long dt = tick - game->log_tick;
+    LogEntry *ent;
+
+    if (game->replay) return;
+    if (log->count >= REPLAY_MAX_EVENTS) { log->truncated = 1; return; }
+
+    ent = &log->ev[log->count++];
+    ent->dt = (dt > 0xFFFF) ? 0xFFFF : (unsigned short)dt;
+    ent->type = (unsigned char)type;
+    ent->param = (unsigned char)param;
+    game->log_tick = tick;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : replay_event
+ * 概要   : 記録から次のイベントを取り出す (記録時と同じ間隔で返す)
+ * 戻り値 : 記録されていたイベント (記録の終わり、または 'q' で EVT_QUIT)
+ * 詳細   : 
+ * 記録時刻に達するまでは通常の入力待ちと同じく描画と CPU 譲渡を行う。
+ * ここで出会ったお邪魔ラインの記録 (processGarbage が消費しなかった分) は
+ * 読み飛ばす。
+ * --------------------------------------------------------------------------- */
+Event replay_event(TetrisGame *game) {
+    ReplayLog *log = &replay_logs[game->port_id];
+    Event e;
+
+    while (game->replay_pos < log->count) {
+        LogEntry *ent = &log->ev[game->replay_pos];
+        unsigned long due = game->log_tick + ent->dt;
+
+        while (tick < due) {
+            if (inbyte(game->port_id) == 'q') { e.type = EVT_QUIT; return e; }
+            idle_poll(game);
+            skipmt();
+        }
+        game->log_tick = due;
+        game->replay_pos++;
+        if (ent->type == LOG_GARBAGE) continue;
+
+        e.type = (EventType)ent->type;
+        e.param = ent->param;
+        return e;
+    }
+    e.type = EVT_QUIT;
+    return e;
+}
+
 /* ***************************************************************************
  * 8. ゲームロジック
  * *************************************************************************** */
@@ -482,6 +1896,91 @@ int isHit(TetrisGame *game, int _minoX, int _minoY, int _minoType, int _minoAngl
     return 0;
 }
 
+/* ---------------------------------------------------------------------------
+ * 関数名 : row_range_mask
+ * 概要   : top〜bottom 行のビットマップを返す (フィールド外は切り捨て)
+ * --------------------------------------------------------------------------- */
+unsigned long row_range_mask(int top, int bottom) {
+    if (top < 0) top = 0;
+    if (bottom > FIELD_HEIGHT - 1) bottom = FIELD_HEIGHT - 1;
+    if (top > bottom) return 0;
+    return ((1UL << (bottom + 1)) - 1) & ~((1UL << top) - 1);
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : mark_field_rows
+ * 概要   : フィールドの top〜bottom 行を書き換えたことを記録する
+ * 詳細   : フィールドが変わるとゴーストの位置も変わり得るため、
+ * ミノの再配置も要求する。
+ * --------------------------------------------------------------------------- */
+void mark_field_rows(TetrisGame *game, int top, int bottom) {
+    game->dirty_rows |= row_range_mask(top, bottom);
+    game->piece_dirty = 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : mark_piece_dirty
+ * 概要   : 操作中ミノの移動・回転・交代を記録する
+ * --------------------------------------------------------------------------- */
+void mark_piece_dirty(TetrisGame *game) {
+    game->piece_dirty = 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : rng_seed / rng_next / rng_range
+ * 概要   : ゲーム毎の乱数 (xorshift32)
+ * 詳細   : 
+ * 状態は Rng 構造体に閉じており、同じ種からは常に同じ系列が得られる。
+ * xorshift は状態 0 から抜け出せないため、種 0 は固定値に置き換える。
+ * --------------------------------------------------------------------------- */
+void rng_seed(Rng *rng, unsigned long seed) {
+    rng->s = (seed & 0xFFFFFFFFUL) ? (seed & 0xFFFFFFFFUL) : 0x2545F491UL;
+}
+
+unsigned long rng_next(Rng *rng) {
+    unsigned long x = rng->s;
+    x ^= (x << 13) & 0xFFFFFFFFUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xFFFFFFFFUL;
+    rng->s = x;
+    return x;
+}
+
+/* 0 〜 n-1 の値 */
+int rng_range(Rng *rng, int n) {
+    return (int)(rng_next(rng) % (unsigned long)n);
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : propose_seed
+ * 概要   : 次の対戦の乱数の種を提案する (sync_generation を進める前に呼ぶ)
+ * 詳細   : 
+ * キー入力時の tick と前回の種を混ぜた値を seed_proposal に公開する。
+ * 相手は sync_generation の一致を確認した後にこの値を読む。
+ * --------------------------------------------------------------------------- */
+void propose_seed(TetrisGame *game) {
+    game->seed_proposal = (tick * 2654435761UL) ^ (game->match_seed * 69069UL) ^ (game->port_id + 1);
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : agree_seed
+ * 概要   : 全員の提案から対戦の種を決める (同期完了後に呼ぶ)
+ * 詳細   : 
+ * 全員の提案の排他的論理和は、どのプレイヤーの側で計算しても同じ値になる。
+ * ミノ用の乱数は種そのもので、お邪魔用の乱数はポート番号を混ぜて初期化する。
+ * FIXED_SEED が指定されていればそれを使う (対戦全体が再現可能になる)。
+ * --------------------------------------------------------------------------- */
+void agree_seed(TetrisGame *game) {
+    unsigned long seed = 0;
+    int id;
+
+    for (id = 0; id < NUM_PLAYERS; id++) {
+        if (all_games[id] != NULL) seed ^= all_games[id]->seed_proposal;
+    }
+    if (FIXED_SEED != 0) seed = FIXED_SEED;
+    game->match_seed = seed;
+}
+
 /* ---------------------------------------------------------------------------
  * 関数名 : fillBag
  * 概要   : ミノ生成用バッグの補充 (7種1巡の法則)
@@ -492,7 +1991,7 @@ void fillBag(TetrisGame *game) {
     for (i = 0; i < 7; i++) game->bag[i] = i;
     /* シャッフル */
     for (i = 6; i > 0; i--) {
-        j = (tick + rand()) % (i + 1); 
+        j = rng_range(&game->bag_rng, i + 1);
         temp = game->bag[i]; game->bag[i] = game->bag[j]; game->bag[j] = temp;
     }
     game->bag_index = 0;
@@ -506,7 +2005,9 @@ void resetMino(TetrisGame *game) {
     game->minoX = 5;
     game->minoY = 0;
     game->minoType = game->nextMinoType;
-    game->minoAngle = (tick + rand()) % MINO_ANGLE_MAX;
+    game->minoAngle = rng_range(&game->bag_rng, MINO_ANGLE_MAX);
+    game->piece_no++;
+    mark_piece_dirty(game);
     
     /* バッグが空なら補充 */
     if (game->bag_index >= 7) fillBag(game);
@@ -515,27 +2016,192 @@ void resetMino(TetrisGame *game) {
     game->bag_index++;
 }
 
+/* ---------------------------------------------------------------------------
+ * 関数名 : send_garbage
+ * 概要   : お邪魔ラインを相手の受信箱に送る
+ * 詳細   : 
+ * 相手の garbage_sent のうち送信元 (自分) の要素だけを加算する。
+ * この要素を書くのは送信元タスクだけなので、排他制御は不要。
+ * (long の読み書きは1命令で行われ、割り込みで分断されない)
+ * --------------------------------------------------------------------------- */
+void send_garbage(TetrisGame *from, TetrisGame *to, int lines) {
+    to->garbage_sent[from->port_id] += lines;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : player_alive
+ * 概要   : プレイヤー id が接続済みで、まだゲームオーバーでないか
+ * --------------------------------------------------------------------------- */
+int player_alive(int id) {
+    return all_games[id] != NULL && !all_games[id]->is_gameover;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : alive_opponents
+ * 概要   : 自分以外の生存者の数
+ * --------------------------------------------------------------------------- */
+int alive_opponents(TetrisGame *game) {
+    int id, n = 0;
+    for (id = 0; id < NUM_PLAYERS; id++) {
+        if (id != game->port_id && player_alive(id)) n++;
+    }
+    return n;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : next_alive
+ * 概要   : ポート番号順で自分の次の生存者 (-1 = いない)
+ * --------------------------------------------------------------------------- */
+int next_alive(TetrisGame *game) {
+    int k;
+    for (k = 1; k < NUM_PLAYERS; k++) {
+        int id = (game->port_id + k) % NUM_PLAYERS;
+        if (player_alive(id)) return id;
+    }
+    return -1;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : current_target
+ * 概要   : 攻撃先 (相手画面に表示する相手) を返す
+ * 戻り値 : 攻撃先のゲーム, NULL = 生存している相手がいない
+ * 詳細   : 
+ * 攻撃先が生存していればそのまま返す (毎回の判定は O(1))。
+ * 脱落した場合だけ next_alive で次の相手に切り替える。生存者がいなければ
+ * target は最後の相手のまま残す (target >= 0 で NULL なら勝利)。
+ * --------------------------------------------------------------------------- */
+TetrisGame *current_target(TetrisGame *game) {
+    int id;
+    if (game->target >= 0 && player_alive(game->target)) return all_games[game->target];
+    id = next_alive(game);
+    if (id < 0) return NULL;
+    game->target = id;
+    return all_games[id];
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : route_attack
+ * 概要   : お邪魔ラインの送り先を ATTACK_ROUTE に従って決める
+ * 戻り値 : 送り先のゲーム, NULL = 送り先なし
+ * 詳細   : 
+ * ROUTE_RANDOM / ROUTE_HIGHEST で選んだ相手は target にもなり、
+ * 相手画面の表示もその相手に切り替わる。
+ * --------------------------------------------------------------------------- */
+TetrisGame *route_attack(TetrisGame *game) {
+    int id, k, n;
+    TetrisGame *to = current_target(game);
+
+    if (to == NULL) return NULL;
+    switch (ATTACK_ROUTE) {
+        case ROUTE_RANDOM:
+            /* 生存者の中から k 番目を選ぶ */
+            k = rng_range(&game->route_rng, alive_opponents(game));
+            for (id = 0, n = 0; id < NUM_PLAYERS; id++) {
+                if (id == game->port_id || !player_alive(id)) continue;
+                if (n++ == k) { game->target = id; break; }
+            }
+            break;
+        case ROUTE_HIGHEST:
+            /* 同じ高さなら今の攻撃先を優先する */
+            for (id = 0; id < NUM_PLAYERS; id++) {
+                if (id == game->port_id || !player_alive(id)) continue;
+                if (all_games[id]->stack_height > all_games[game->target]->stack_height) {
+                    game->target = id;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+    return all_games[game->target];
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : update_stack_height
+ * 概要   : 積み上がりの高さを公開する (ミノ固定・せり上がりの後に呼ぶ)
+ * --------------------------------------------------------------------------- */
+void update_stack_height(TetrisGame *game) {
+    int i, j;
+    for (i = 0; i < FIELD_HEIGHT - 1; i++) {
+        for (j = 1; j < FIELD_WIDTH - 1; j++) if (game->field[i][j]) break;
+        if (j < FIELD_WIDTH - 1) break;
+    }
+    game->stack_height = FIELD_HEIGHT - 1 - i;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : match_end_phase
+ * 概要   : 自分の試合が終わったとき、決着していれば結果表示フェーズにする
+ * 詳細   : 
+ * 自分以外の生存者が1人以下 (勝者が決まった) ならターボの時間を止める。
+ * 3人以上の対戦で途中で脱落した場合は、残りの対戦を続けさせる。
+ * --------------------------------------------------------------------------- */
+void match_end_phase(TetrisGame *game) {
+    if (alive_opponents(game) <= 1) turbo_phase(PHASE_RESULT);
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : garbage_pending
+ * 概要   : 受け取ったがまだせり上げていないお邪魔ライン数
+ * 詳細   : 送信元ごとに (送信累計 - 受け取り済み累計) を合計する。
+ * --------------------------------------------------------------------------- */
+int garbage_pending(TetrisGame *game) {
+    int s;
+    unsigned long total = 0;
+    for (s = 0; s < NUM_PLAYERS; s++) total += game->garbage_sent[s] - game->garbage_taken[s];
+    return (int)total;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : take_garbage
+ * 概要   : 受信箱から最大 max_lines 行を取り出す
+ * 戻り値 : 取り出した行数
+ * 詳細   : 
+ * 送信累計は1回だけ読み、その値までを受け取り済みとする。
+ * 読んだ後に送信元が加算した分は、次回の取り出しに残る。
+ * --------------------------------------------------------------------------- */
+int take_garbage(TetrisGame *game, int max_lines) {
+    int s, lines = 0;
+    for (s = 0; s < NUM_PLAYERS && lines < max_lines; s++) {
+        unsigned long avail = game->garbage_sent[s] - game->garbage_taken[s];
+        if (avail > (unsigned long)(max_lines - lines)) avail = max_lines - lines;
+        game->garbage_taken[s] += avail;
+        lines += (int)avail;
+    }
+    return lines;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : discard_garbage
+ * 概要   : 受信済みのお邪魔ラインを全て破棄する (ゲーム開始時)
+ * --------------------------------------------------------------------------- */
+void discard_garbage(TetrisGame *game) {
+    int s;
+    for (s = 0; s < NUM_PLAYERS; s++) game->garbage_taken[s] = game->garbage_sent[s];
+}
+
 /* ---------------------------------------------------------------------------
  * 関数名 : processGarbage
  * 概要   : お邪魔ブロックの処理
- * 詳細   : セマフォを用いて共有変数 pending_garbage を排他制御しながら読み書きする。
+ * 詳細   : 受信箱から一度に4行までを取り出し、フィールドをせり上げる。
+ * 行数は入力記録にも残し、再生時は記録の値を使う。
  * 戻り値 : 1 = 押し出されてゲームオーバー, 0 = 正常
  * --------------------------------------------------------------------------- */
 int processGarbage(TetrisGame *game) {
     int lines;
-    
-    /* --- クリティカルセクション開始 --- */
-    P(SEM_GARBAGE_LOCK);
-    lines = game->pending_garbage;
-    if (lines > 0) {
-        if (lines > 4) {
-            game->pending_garbage -= 4; lines = 4; /* 一度は4行まで */
-        } else {
-            game->pending_garbage = 0;
-        }
+
+    if (game->replay) {
+        /* 再生時は受信箱ではなく記録からせり上がり行数を得る */
+        ReplayLog *log = &replay_logs[game->port_id];
+        LogEntry *ent = &log->ev[game->replay_pos];
+        if (game->replay_pos >= log->count || ent->type != LOG_GARBAGE) return 0;
+        game->log_tick += ent->dt;
+        game->replay_pos++;
+        lines = ent->param;
+    } else {
+        lines = take_garbage(game, 4); /* 一度は4行まで */
+        if (lines > 0) log_append(game, LOG_GARBAGE, lines);
     }
-    V(SEM_GARBAGE_LOCK);
-    /* --- クリティカルセクション終了 --- */
 
     if (lines <= 0) return 0;
 
@@ -555,46 +2221,247 @@ int processGarbage(TetrisGame *game) {
         game->field[i][0] = 1; game->field[i][FIELD_WIDTH - 1] = 1; /* 壁 */
         for (j = 1; j < FIELD_WIDTH - 1; j++) game->field[i][j] = 2 + MINO_TYPE_GARBAGE; 
         /* ランダムに1箇所穴を開ける */
-        int hole = 1 + (tick + rand() + i) % (FIELD_WIDTH - 2);
+        int hole = 1 + rng_range(&game->aux_rng, FIELD_WIDTH - 2);
         game->field[i][hole] = 0;
     }
+    mark_field_rows(game, 0, FIELD_HEIGHT - 2);
     return 0; 
 }
 
+/* ---------------------------------------------------------------------------
+ * 関数名 : bot_put
+ * 概要   : ボットの探索用にミノをフィールドへ仮に置く / 取り除く
+ * 戻り値 : 置いた結果埋まった行のビットマップ (val=0 で取り除いたときは 0)
+ * 詳細   : 
+ * 探索は自分の field を直接書き換えて評価し、すぐ元に戻す。
+ * field を読むのは自タスクだけなので、途中で切り替わっても問題ない。
+ * (mark_field_rows は呼ばないので描画にも影響しない)
+ * --------------------------------------------------------------------------- */
+unsigned long bot_put(TetrisGame *game, int x, int y, int type, int angle, char val) {
+    int i, j;
+    unsigned long full = 0;
+    for (i = 0; i < MINO_HEIGHT; i++) {
+        for (j = 0; j < MINO_WIDTH; j++) {
+            if (minoShapes[type][angle][i][j]) game->field[y + i][x + j] = val;
+        }
+    }
+    if (!val) return 0;
+    for (i = 0; i < MINO_HEIGHT && y + i < FIELD_HEIGHT - 1; i++) {
+        for (j = 1; j < FIELD_WIDTH - 1; j++) if (!game->field[y + i][j]) break;
+        if (j == FIELD_WIDTH - 1) full |= 1UL << (y + i);
+    }
+    return full;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : bot_evaluate
+ * 概要   : 盤面の評価値 (大きいほど良い)
+ * 詳細   : 
+ * full の行は消えたものとして扱い、消去行数・穴の数・高さの合計・
+ * 隣り合う列の高さの差の合計に重みを掛けて足し合わせる。
+ * --------------------------------------------------------------------------- */
+long bot_evaluate(TetrisGame *game, unsigned long full) {
+    int x, y, r = 0, prev_h = -1;
+    int lines = 0, holes = 0, height = 0, bump = 0;
+    int rank[FIELD_HEIGHT]; /* 各行の床からの高さ (消える行を除いて数える) */
+
+    for (y = FIELD_HEIGHT - 2; y >= 0; y--) {
+        if (full & (1UL << y)) lines++;
+        else r++;
+        rank[y] = r;
+    }
+    for (x = 1; x < FIELD_WIDTH - 1; x++) {
+        int h = 0;
+        for (y = 0; y < FIELD_HEIGHT - 1; y++) {
+            if (full & (1UL << y)) continue;
+            if (game->field[y][x]) { if (!h) h = rank[y]; }
+            else if (h) holes++;
+        }
+        height += h;
+        if (prev_h >= 0) bump += (h > prev_h) ? h - prev_h : prev_h - h;
+        prev_h = h;
+    }
+    return (long)BOT_W_LINES * lines - (long)BOT_W_HOLES * holes
+         - (long)BOT_W_HEIGHT * height - (long)BOT_W_BUMP * bump;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : bot_best_next
+ * 概要   : 次のミノを出現位置から置いたときの最良の評価値
+ * 詳細   : 
+ * 1手目で埋まった行 (full) はフィールドに残ったまま探索する (近似)。
+ * 置き場所がなければ BOT_SCORE_MIN を返す。
+ * --------------------------------------------------------------------------- */
+long bot_best_next(TetrisGame *game, unsigned long full) {
+    int a, x, type = game->nextMinoType;
+    long best = BOT_SCORE_MIN;
+
+    for (a = 0; a < MINO_ANGLE_MAX; a++) {
+        if (isHit(game, 5, 0, type, a)) continue;
+        for (x = 5; !isHit(game, x - 1, 0, type, a); x--) ;
+        for (; !isHit(game, x, 0, type, a); x++) {
+            int y = 0;
+            while (!isHit(game, x, y + 1, type, a)) y++;
+            long s = bot_evaluate(game, full | bot_put(game, x, y, type, a, 2 + type));
+            bot_put(game, x, y, type, a, CELL_EMPTY);
+            if (s > best) best = s;
+        }
+    }
+    return best;
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : bot_plan
+ * 概要   : 現在のミノの置き場所 (bot_x, bot_angle) を決める
+ * 詳細   : 
+ * 1. 現在位置で回転し、同じ高さで横に移動して、真下に落とせる置き場所を全て評価する。
+ * 2. 評価値の上位 BOT_BEAM 件について、次のミノ (nextMinoType) を置いた後の
+ *    最良値で比べ直す。
+ * --------------------------------------------------------------------------- */
+void bot_plan(TetrisGame *game) {
+    BotMove beam[BOT_BEAM + 1];
+    int n = 0, a, x, i;
+    int type = game->minoType, y0 = game->minoY;
+    long best;
+
+    game->bot_x = game->minoX;
+    game->bot_angle = game->minoAngle;
+    best = BOT_SCORE_MIN;
+
+    /* --- 1. 現在のミノ --- */
+    for (a = 0; a < MINO_ANGLE_MAX; a++) {
+        if (isHit(game, game->minoX, y0, type, a)) continue;
+        /* 同じ高さで左右に動ける範囲 */
+        for (x = game->minoX; !isHit(game, x - 1, y0, type, a); x--) ;
+        for (; !isHit(game, x, y0, type, a); x++) {
+            int y = y0;
+            while (!isHit(game, x, y + 1, type, a)) y++;
+            BotMove m;
+            m.x = x; m.angle = a;
+            m.score = bot_evaluate(game, bot_put(game, x, y, type, a, 2 + type));
+            bot_put(game, x, y, type, a, CELL_EMPTY);
+
+            if (m.score > best) { best = m.score; game->bot_x = x; game->bot_angle = a; }
+            /* 上位 BOT_BEAM 件を評価値の降順に保持する */
+            for (i = n; i > 0 && beam[i - 1].score < m.score; i--) beam[i] = beam[i - 1];
+            beam[i] = m;
+            if (n < BOT_BEAM) n++;
+        }
+    }
+
+    /* --- 2. 次のミノまで先読み --- */
+    best = BOT_SCORE_MIN;
+    for (i = 0; i < n; i++) {
+        int y = y0;
+        while (!isHit(game, beam[i].x, y + 1, type, beam[i].angle)) y++;
+        unsigned long full = bot_put(game, beam[i].x, y, type, beam[i].angle, 2 + type);
+        long s = bot_best_next(game, full);
+        bot_put(game, beam[i].x, y, type, beam[i].angle, CELL_EMPTY);
+        if (s > best) { best = s; game->bot_x = beam[i].x; game->bot_angle = beam[i].angle; }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : bot_input
+ * 概要   : ボットの操作キーを1つ返す (inbyte の代わり)
+ * 戻り値 : キーコード, -1 = 操作なし
+ * 詳細   : 
+ * 新しいミノが出たら置き場所を決め、回転 → 横移動 → ハードドロップの順に
+ * 1操作ずつ返す。操作の間隔は bot_aps で決まる。
+ * 壁蹴りなどで目標に届かない場合は BOT_MAX_MOVES 回でハードドロップする。
+ * --------------------------------------------------------------------------- */
+int bot_input(TetrisGame *game) {
+    if (game->state != GS_PLAYING || tick < game->bot_next_tick) return -1;
+    game->bot_next_tick = tick + BOT_ACTION_TICKS(game->bot_aps);
+
+    if (game->bot_piece != game->piece_no) {
+        game->bot_piece = game->piece_no;
+        game->bot_moves = 0;
+        MTK_PROFILE_SCOPE(bot_plan) {
+            bot_plan(game);
+        }
+    }
+    if (++game->bot_moves > BOT_MAX_MOVES) return 'w';
+    if (game->minoAngle != game->bot_angle) return ' ';
+    if (game->minoX < game->bot_x) return 'd';
+    if (game->minoX > game->bot_x) return 'a';
+    return 'w';
+}
+
 /* ***************************************************************************
  * 9. 画面遷移・同期処理
  * *************************************************************************** */
 
+/* ---------------------------------------------------------------------------
+ * 関数名 : wait_players
+ * 概要   : 全プレイヤーと同期する (sync_generation の一致を待つ)
+ * 詳細   : 
+ * まだ試合中のプレイヤーがいれば、その試合が終わって再戦を選ぶまで待つ。
+ * プレイヤーのタスクは起動直後に all_games へ登録するので、未登録の間も待つ
+ * (全員がそろってから種と攻撃先を決める)。
+ * --------------------------------------------------------------------------- */
+void wait_players(TetrisGame *game) {
+    int id;
+    for (id = 0; id < NUM_PLAYERS; id++) {
+        while (all_games[id] == NULL || all_games[id]->sync_generation != game->sync_generation) {
+            skipmt();
+        }
+    }
+}
+
 /* ---------------------------------------------------------------------------
  * 関数名 : wait_start
  * 概要   : ゲーム開始時の同期待機
- * 詳細   : 双方の準備が整うまで待機し、乱数シードを初期化する。
+ * 詳細   : 
+ * 全員の準備が整うまで待機し、乱数シードを初期化する。
+ * 開始前に以下のキーでそのポートの表示設定を変更できる。
+ *   '1'〜'3' : カラープロファイル (24bit / 256色 / 16色)
+ *   'c'      : 相手画面の通常表示 / 縮小表示の切り替え
+ *   's'      : スクロールによる行移動の切り替え (端末が左右マージンに対応している場合のみ有効にする)
+ *   'b'      : ボット操作の切り替え
+ * それ以外のキーで開始する。
  * --------------------------------------------------------------------------- */
 void wait_start(TetrisGame *game) {
-    int opponent_id = (game->port_id == 0) ? 1 : 0;
+    int c;
+    spec_keyframe(game);
     fprintf(game->fp_out, ESC_CLS ESC_HOME);
     fprintf(game->fp_out, "============================\n");
-    fprintf(game->fp_out, "   TETRIS: 2-PLAYER BATTLE  \n");
+    fprintf(game->fp_out, "   TETRIS: %d-PLAYER BATTLE  \n", NUM_PLAYERS);
     fprintf(game->fp_out, "============================\n");
     fprintf(game->fp_out, "\nPress Any Key to Start...\n");
-    fflush(game->fp_out);
+    fprintf(game->fp_out, "(1: 24bit / 2: 256 / 3: 16 colors, C: compact rival view,\n");
+    fprintf(game->fp_out, " S: scroll rows (needs DECLRMM), B: bot)\n");
 
-    /* キー入力待ち */
-    while (1) { if (inbyte(game->port_id) != -1) break; skipmt(); }
+    /* キー入力待ち (設定変更キーの間は設定を表示して待ち続ける) */
+    /* BOT_PORTS のポートは入力を待たずに開始する */
+    while (1) {
+        fprintf(game->fp_out, "\r" ESC_CLR_LINE "Color: %s  Rival: %s  Scroll: %s  Bot: %s",
+                colorProfileNames[game->color_profile],
+                (game->rival_view == RIVAL_VIEW_COMPACT) ? "compact" : "full",
+                game->scroll_accel ? "on" : "off",
+                game->bot_aps ? "on" : "off");
+        fflush(game->fp_out);
+        FRAME_MARK(game->port_id);
+        if (BOT_PORTS & (1 << game->port_id)) break;
+
+        while ((c = inbyte(game->port_id)) == -1) skipmt();
+        if (c >= '1' && c < '1' + COLOR_PROFILE_MAX) game->color_profile = c - '1';
+        else if (c == 'c' || c == 'C') game->rival_view = !game->rival_view;
+        else if (c == 's' || c == 'S') game->scroll_accel = !game->scroll_accel;
+        else if (c == 'b' || c == 'B') game->bot_aps = game->bot_aps ? 0 : BOT_APS;
+        else break;
+    }
     
-    srand((unsigned int)tick); /* 乱数初期化 */
+    propose_seed(game); /* 乱数の種の提案 */
     game->sync_generation++;
     
-    fprintf(game->fp_out, ESC_CLR_LINE "\rWaiting for opponent...   \n");
+    fprintf(game->fp_out, "\r" ESC_CLR_LINE "Waiting for opponent...   \n");
     fflush(game->fp_out);
+    FRAME_MARK(game->port_id);
 
-    /* 相手との同期 (sync_generationの一致を確認) */
-    while (1) {
-        if (all_games[opponent_id] != NULL) {
-            if (all_games[opponent_id]->sync_generation == game->sync_generation) break;
-        } else break; /* 相手がいない場合は即開始 */
-        skipmt();
-    }
+    wait_players(game);
+    agree_seed(game);
+    game->replay = 0;
 }
 
 /* ---------------------------------------------------------------------------
@@ -602,30 +2469,49 @@ void wait_start(TetrisGame *game) {
  * 概要   : ゲーム終了後のリトライ待機
  * --------------------------------------------------------------------------- */
 void wait_retry(TetrisGame *game) {
-    int opponent_id = (game->port_id == 0) ? 1 : 0;
-    fprintf(game->fp_out, "\nPress 'R' to Retry...\n");
+    unsigned long auto_retry = tick + BOT_RETRY_TICKS; /* ボット操作時は自動で再戦 */
+    show_latency(game);
+#ifdef MTK_PROFILE
+    mtk_prof_report(game->fp_out);
+#endif
+    fprintf(game->fp_out, "\nPress 'R' to Retry, 'P' to Replay...\n");
+#ifdef MTK_TRACE
+    fprintf(game->fp_out, "('T' dumps the kernel trace)\n");
+#endif
     fflush(game->fp_out);
+    FRAME_MARK(game->port_id);
     
     while (1) {
         int c = inbyte(game->port_id);
         if (c == 'r' || c == 'R') break; 
+#ifdef MTK_TRACE
+        /* カーネルのトレースをこのポートへ書き出す (trace2chrome.py で変換する) */
+        if (c == 't' || c == 'T') mtk_trace_dump(game->fp_out);
+#endif
+        if (game->bot_aps && tick >= auto_retry) break;
+        if ((c == 'p' || c == 'P') && replay_logs[game->port_id].count > 0) {
+            /* 次の同期世代を再生として両者に知らせる */
+            g_replay_generation = game->sync_generation + 1;
+            break;
+        }
         skipmt();
     }
-    srand((unsigned int)tick + rand());
+    propose_seed(game);
     game->sync_generation++;
     fprintf(game->fp_out, ESC_CLR_LINE "\rWaiting for opponent...   \n");
     fflush(game->fp_out);
+    FRAME_MARK(game->port_id);
     
-    while (1) {
-        if (all_games[opponent_id] != NULL) {
-            if (all_games[opponent_id]->sync_generation == game->sync_generation) break;
-        } else break;
-        skipmt();
-    }
+    wait_players(game);
+    agree_seed(game);
+    /* どちらかが再生を選んだ場合は両者とも直前の試合を再生する */
+    game->replay = (g_replay_generation == game->sync_generation &&
+                    replay_logs[game->port_id].count > 0);
 }
 
 void show_gameover_message(TetrisGame *game) {
-    fprintf(game->fp_out, ESC_CLS ESC_HOME "%s", COL_BLUE);
+    spec_keyframe(game);
+    fprintf(game->fp_out, ESC_CLS ESC_HOME "%s", paletteSeq[game->color_profile][PAL_BLUE]);
     fprintf(game->fp_out, "============================\n");
     fprintf(game->fp_out, "         GAME OVER          \n");
     fprintf(game->fp_out, "          YOU LOSE          \n");
@@ -635,7 +2521,8 @@ void show_gameover_message(TetrisGame *game) {
 }
 
 void show_victory_message(TetrisGame *game) {
-    fprintf(game->fp_out, ESC_CLS ESC_HOME "%s", COL_RED);
+    spec_keyframe(game);
+    fprintf(game->fp_out, ESC_CLS ESC_HOME "%s", paletteSeq[game->color_profile][PAL_RED]);
     fprintf(game->fp_out, "============================\n");
     fprintf(game->fp_out, "      CONGRATULATIONS!      \n");
     fprintf(game->fp_out, "          YOU WIN!          \n");
@@ -659,38 +2546,59 @@ void run_tetris(TetrisGame *game) {
     int i;
     
     /* リトライ時の初期フェーズ設定 (Player 1のみが更新) */
-    if (game->port_id == 0) g_system_phase = PHASE_IDLE;
+    if (game->port_id == 0) turbo_phase(PHASE_IDLE);
     
     /* 変数初期化 */
-    game->score = 0; game->lines_cleared = 0; game->pending_garbage = 0;
+    game->score = 0; game->lines_cleared = 0; discard_garbage(game);
     game->is_gameover = 0; game->state = GS_PLAYING; 
     game->lines_to_clear = 0; game->seq_state = 0;
-    game->opponent_was_connected = 0; game->prevNextMinoType = -1; 
+    game->opp_view_id = -1; game->prevNextMinoType = -1; 
+    game->dirty_rows = 0; game->piece_rows = 0; game->opp_seen_frame = 0;
+    game->opp_snap_seq = 1; game->opp_score = 0; game->opp_lines = 0;
+    game->frame_pending = 0; game->next_frame = mtk_now_cycles();
+    game->next_poll_tick = tick + DISPLAY_POLL_INTERVAL;
+    game->piece_no = 0; game->bot_piece = 0; game->bot_next_tick = 0;
+    game->input_pending = 0; game->lat_count = game->lat_sum = game->lat_max = 0;
+    game->stack_height = 0; game->target = -1;
+    memset(game->lat_hist, 0, sizeof(game->lat_hist));
     
     /* バッファ・画面初期化 */
     memset(game->prevBuffer, -1, sizeof(game->prevBuffer));
     memset(game->prevOpponentBuffer, -1, sizeof(game->prevOpponentBuffer));
+    memset(game->prevMiniBuffer, 0xFF, sizeof(game->prevMiniBuffer));
+    memset(game->oppSnapshot, CELL_EMPTY, sizeof(game->oppSnapshot));
+    game->own_force_rows = game->opp_force_rows = ALL_ROWS_MASK;
+    spec_keyframe(game);
     fprintf(game->fp_out, ESC_CLS ESC_HIDE_CUR); 
+    term_invalidate(game);
+    game->hdr.valid = 0;
     
     /* フィールド枠作成 */
     memset(game->field, 0, sizeof(game->field));
     for (i = 0; i < FIELD_HEIGHT; i++) game->field[i][0] = game->field[i][FIELD_WIDTH - 1] = 1; 
     for (i = 0; i < FIELD_WIDTH; i++) game->field[FIELD_HEIGHT - 1][i] = 1; 
-
-    /* ミノ生成 */
+    mark_field_rows(game, 0, FIELD_HEIGHT - 1);
+
+    /* ミノ生成 (合意した種から乱数を初期化. 再生時は記録した種) */
+    if (game->replay) game->match_seed = replay_logs[game->port_id].seed;
+    rng_seed(&game->bag_rng, game->match_seed);
+    rng_seed(&game->aux_rng, game->match_seed ^ (0x9E3779B9UL * (game->port_id + 1)));
+    rng_seed(&game->route_rng, game->match_seed ^ (0x85EBCA6BUL * (game->port_id + 1)));
+    current_target(game); /* 最初の攻撃先はポート番号順で次の相手 */
     fillBag(game); game->nextMinoType = game->bag[game->bag_index++]; resetMino(game); 
     
     display(game);
     
     /* カウントダウン開始合図 */
-    if (game->port_id == 0) g_system_phase = PHASE_COUNTDOWN;
+    if (game->port_id == 0) turbo_phase(PHASE_COUNTDOWN);
     perform_countdown(game);
     display(game);
     
     /* ゲーム開始合図 (ここからゲージ進行開始) */
-    if (game->port_id == 0) g_system_phase = PHASE_PLAYING;
+    if (game->port_id == 0) turbo_phase(PHASE_PLAYING);
     
     game->next_drop_time = tick + g_current_drop_interval;
+    log_begin(game);
 
     /* イベントループ */
     while (1) {
@@ -711,14 +2619,10 @@ void run_tetris(TetrisGame *game) {
                     case 4: attack = 4; break;
                 }
                 
-                /* お邪魔ブロックの送信 (排他制御) */
+                /* お邪魔ブロックの送信 (送り先の受信箱の自分用カウンタに加算) */
                 if (attack > 0) {
-                    int opponent_id = (game->port_id == 0) ? 1 : 0;
-                    if (all_games[opponent_id] != NULL && !all_games[opponent_id]->is_gameover) {
-                        P(SEM_GARBAGE_LOCK);
-                        all_games[opponent_id]->pending_garbage += attack;
-                        V(SEM_GARBAGE_LOCK);
-                    }
+                    TetrisGame *to = route_attack(game);
+                    if (to != NULL) send_garbage(game, to, attack);
                 }
                 
                 /* スコア計算 (ターボ倍率適用) */
@@ -744,10 +2648,10 @@ void run_tetris(TetrisGame *game) {
         switch (e.type) {
             case EVT_WIN:
                 /* 勝利時もゲーム終了合図 */
-                if (game->port_id == 0) g_system_phase = PHASE_RESULT;
+                match_end_phase(game);
                 show_victory_message(game); wait_retry(game); return; 
             case EVT_QUIT:
-                if (game->port_id == 0) g_system_phase = PHASE_RESULT;
+                match_end_phase(game);
                 fprintf(game->fp_out, "%sQuit.\n", ESC_SHOW_CUR); wait_retry(game); return;
             case EVT_KEY_INPUT:
                 /* キー操作 (移動・回転) */
@@ -755,13 +2659,18 @@ void run_tetris(TetrisGame *game) {
                     case 's': 
                         if (!isHit(game, game->minoX, game->minoY + 1, game->minoType, game->minoAngle)) {
                             game->minoY++; game->next_drop_time = tick + g_current_drop_interval;
+                            mark_piece_dirty(game);
                         }
                         break;
                     case 'a': 
-                        if (!isHit(game, game->minoX - 1, game->minoY, game->minoType, game->minoAngle)) game->minoX--;
+                        if (!isHit(game, game->minoX - 1, game->minoY, game->minoType, game->minoAngle)) {
+                            game->minoX--; mark_piece_dirty(game);
+                        }
                         break;
                     case 'd': 
-                        if (!isHit(game, game->minoX + 1, game->minoY, game->minoType, game->minoAngle)) game->minoX++;
+                        if (!isHit(game, game->minoX + 1, game->minoY, game->minoType, game->minoAngle)) {
+                            game->minoX++; mark_piece_dirty(game);
+                        }
                         break;
                     case ' ': 
                         {
@@ -769,16 +2678,18 @@ void run_tetris(TetrisGame *game) {
                             if (!isHit(game, game->minoX, game->minoY, game->minoType, newAngle)) game->minoAngle = newAngle;
                             else if (!isHit(game, game->minoX + 1, game->minoY, game->minoType, newAngle)) { game->minoX++; game->minoAngle = newAngle; }
                             else if (!isHit(game, game->minoX - 1, game->minoY, game->minoType, newAngle)) { game->minoX--; game->minoAngle = newAngle; }
+                            if (game->minoAngle == newAngle) mark_piece_dirty(game);
                         }
                         break;
                     case 'w': 
                         while (!isHit(game, game->minoX, game->minoY + 1, game->minoType, game->minoAngle)) {
                             game->minoY++; game->score += 2 * g_score_multiplier; 
                         }
-                        display(game); goto LOCK_PROCESS; 
+                        mark_piece_dirty(game);
+                        request_display(game); goto LOCK_PROCESS; 
                         break;
                 }
-                display(game);
+                request_display(game);
                 break;
 
             case EVT_TIMER:
@@ -796,6 +2707,7 @@ void run_tetris(TetrisGame *game) {
                             }
                         }
                     }
+                    mark_field_rows(game, game->minoY, game->minoY + MINO_HEIGHT - 1);
                     /* 2. ライン消去判定 */
                     int lines_this_turn = 0;
                     for (i = 0; i < FIELD_HEIGHT - 1; i++) {
@@ -807,6 +2719,7 @@ void run_tetris(TetrisGame *game) {
                             for (k = i; k > 0; k--) memcpy(game->field[k], game->field[k - 1], FIELD_WIDTH);
                             memset(game->field[0], 0, FIELD_WIDTH);
                             game->field[0][0] = game->field[0][FIELD_WIDTH-1] = 1;
+                            mark_field_rows(game, 0, i);
                             lines_this_turn++;
                         }
                     }
@@ -823,23 +2736,25 @@ void run_tetris(TetrisGame *game) {
                     /* 4. お邪魔ブロックのせり上がり処理 */
                     if (processGarbage(game)) {
                         game->is_gameover = 1;
-                        if (game->port_id == 0) g_system_phase = PHASE_RESULT;
+                        match_end_phase(game);
                         fprintf(game->fp_out, "\a"); show_gameover_message(game); wait_retry(game); return;
                     }
                     /* 5. 次のミノのリセットと窒息判定 */
+                    update_stack_height(game);
                     resetMino(game);
                     if (isHit(game, game->minoX, game->minoY, game->minoType, game->minoAngle)) {
                         game->is_gameover = 1;
-                        if (game->port_id == 0) g_system_phase = PHASE_RESULT;
+                        match_end_phase(game);
                         fprintf(game->fp_out, "\a"); show_gameover_message(game); wait_retry(game); return; 
                     }
                     game->next_drop_time = tick + g_current_drop_interval;
                 } else {
                     /* 接地していなければ1段下げる */
                     game->minoY++;
+                    mark_piece_dirty(game);
                     game->next_drop_time = tick + g_current_drop_interval;
                 }
-                display(game);
+                request_display(game);
                 break;
             default: break;
         }
@@ -847,156 +2762,290 @@ void run_tetris(TetrisGame *game) {
 }
 
 /* ***************************************************************************
- * 11. ターボ・オーバードライブ管理タスク
+ * 11. LED ドライバ & ターボ・オーバードライブ管理 (タイマコールバック)
  * *************************************************************************** */
 
+/* --- LED の点灯パターン (bit i が LED i. 1 = 点灯) --- */
+typedef struct {
+    const unsigned char *frames; /* 各コマの点灯状態 */
+    int num_frames;              /* コマ数 */
+    unsigned long hold_ms;       /* 1コマを表示する時間 (ミリ秒) */
+} LedPattern;
+
+#define LED_BAR(n) ((unsigned char)((1u << (n)) - 1)) /* LED0 から n 個を点灯 (レベルメーター) */
+
+const unsigned char led_blink_frames[] = { 0xFF, 0x00 };
+/* MAX時の全点滅 (点灯から始める) */
+const LedPattern led_max_blink = {
+    led_blink_frames, 2, TURBO_BLINK_MS
+};
+
+unsigned char led_shadow;       /* LED に最後に書いた状態 */
+const LedPattern *led_anim;     /* 再生中のパターン (NULL: 静止表示) */
+unsigned long led_start;        /* 再生を始めた時刻 (mtk_now_cycles) */
+MtkTimer led_timer;             /* コマ送り用 (再生中だけ登録する) */
+
 /* ---------------------------------------------------------------------------
- * 関数名 : task_turbo_monitor
- * 概要   : 時間経過監視と難易度・LED制御 (ストップウォッチ方式)
- * 詳細   : 
- * システムフェーズ(g_system_phase)を監視し、プレイ中の場合のみ時間を累積する。
- * 累積時間に基づいて難易度レベルを決定し、落下速度とスコア倍率を更新する。
- * また、レベルに応じてLEDの点灯制御を行う。
+ * 関数名 : led_write
+ * 概要   : LED の点灯状態を書き込む (変わった LED のレジスタだけに書く)
  * --------------------------------------------------------------------------- */
-void task_turbo_monitor(void) {
-    unsigned long current_turbo_ticks = 0; /* 累積経過時間 */
+void led_write(unsigned char state) {
+    unsigned char diff = state ^ led_shadow;
     int i;
-    int flash_state = 0;
-    
-    /* 点滅用カウンタ */
-    int blink_wait_counter = 0;
 
-    while (1) {
-        /* --- 状態に応じた処理 --- */
-        switch (g_system_phase) {
-            case PHASE_IDLE:
-            case PHASE_COUNTDOWN:
-                /* リセット状態: 時間を0に戻し、LEDを消灯 */
-                current_turbo_ticks = 0;
-                g_current_drop_interval = TURBO_BASE_INTERVAL;
-                g_score_multiplier = 1;
-                /* リセット時はカウンタもクリア */
-                blink_wait_counter = 0;
-                flash_state = 0;
-                for (i = 0; i < 8; i++) *leds[i] = ' ';
-                break;
+    for (i = 0; diff != 0; i++, diff >>= 1) {
+        if (diff & 1) *leds[i] = (state & (1 << i)) ? LED_CHAR_ON : LED_CHAR_OFF;
+    }
+    led_shadow = state;
+}
 
-            case PHASE_PLAYING:
-                /* プレイ中: 時間を加算する */
-                current_turbo_ticks += TURBO_UPDATE_PERIOD;
-                /* フォールスルーしてLED更新へ */
-                goto UPDATE_LEVEL;
+/* ---------------------------------------------------------------------------
+ * 関数名 : led_step
+ * 概要   : 再生中のパターンを今の時刻のコマにする (led_timer のコールバック)
+ * 詳細   : 
+ * コマは再生開始からの経過時間 (mtk_now_cycles) で決める。周期動作では
+ * タイマホイールが skipmt でも進むので、呼ばれる回数で数えると点滅の速さが
+ * タスクの切り替え頻度に左右されるためである。変わらなければ LED には書かない。
+ * --------------------------------------------------------------------------- */
+void led_step(void *arg) {
+    unsigned long n;
 
-            case PHASE_RESULT:
-                /* 結果表示中: 時間は進めないが、LEDの状態は維持 (更新処理のみ) */
-                goto UPDATE_LEVEL;
-        }
+    (void)arg;
+    if (led_anim == NULL) return;
+    n = (mtk_now_cycles() - led_start) / (led_anim->hold_ms * (MTK_TIMER_HZ / 1000));
+    led_write(led_anim->frames[n % led_anim->num_frames]);
+}
 
-        /* 待機してループ先頭へ (IDLE/COUNTDOWNの場合はここでcontinue) */
-        {
-            unsigned long wake = tick + TURBO_UPDATE_PERIOD;
-            while (tick < wake) skipmt();
-            continue;
-        }
+/* ---------------------------------------------------------------------------
+ * 関数名 : led_init
+ * 概要   : LED ドライバの初期化 (main から、マルチタスク開始前に呼ぶ)
+ * 詳細   : 
+ * 起動時のレジスタの内容は分からないので、全ての LED に消灯を書いて
+ * シャドウと一致させる。
+ * --------------------------------------------------------------------------- */
+void led_init(void) {
+    int i;
 
-    UPDATE_LEVEL:
-        /* --- レベル計算とパラメータ更新 --- */
-        /* 秒換算 */
-        unsigned long elapsed_sec = current_turbo_ticks / TURBO_TICKS_PER_SEC;
-        
-        /* レベル計算: (経過秒 / MAX到達秒) * 8 */
-        int level = (elapsed_sec * 8) / TURBO_MAX_LEVEL_TIME_SEC;
-        if (level > 8) level = 8;
-
-        /* パラメータ適用 (定数を使用) */
-        switch (level) {
-            case 0: case 1: case 2: /* 通常 */
-                g_current_drop_interval = TURBO_BASE_INTERVAL;
-                g_score_multiplier = 1;
-                break;
-            case 3: case 4: case 5: /* 高速 (1.5倍) */
-                g_current_drop_interval = (TURBO_BASE_INTERVAL * 2) / 3;
-                g_score_multiplier = 2;
-                break;
-            case 6: case 7:         /* ターボ (3.0倍) */
-                g_current_drop_interval = TURBO_BASE_INTERVAL / 3;
-                g_score_multiplier = 4;
-                break;
-            case 8:                 /* MAX (6.0倍) */
-                g_current_drop_interval = TURBO_BASE_INTERVAL / 6;
-                g_score_multiplier = 8;
-                break;
-        }
+    for (i = 0; i < LED_NUM; i++) *leds[i] = LED_CHAR_OFF;
+    led_shadow = 0;
+    led_anim = NULL;
+    led_timer.func = led_step;
+    led_timer.arg = NULL;
+    led_timer.active = 0;
+}
 
-        /* LED出力 */
-        if (level < 8) {
-            /* 通常時はレベルメーター表示 */
-            for (i = 0; i < 8; i++) {
-                if (i < level) *leds[i] = '#'; /* 点灯 */
-                else           *leds[i] = ' '; /* 消灯 */
-            }
-            /* 点滅状態をリセットしておく */
-            blink_wait_counter = 0;
-            flash_state = 0; 
-        } else {
-            /* MAX時の点滅演出 (調整パラメータを使用) */
-            blink_wait_counter++;
-            
-            /* 設定されたサイクル数を超えたら反転 */
-            if (blink_wait_counter >= TURBO_BLINK_CYCLE) {
-                flash_state = !flash_state;
-                blink_wait_counter = 0;
+/* ---------------------------------------------------------------------------
+ * 関数名 : led_set / led_play
+ * 概要   : LED を静止表示にする / パターンを再生する
+ * 詳細   : 
+ * タイマのコールバック (turbo_update) から呼ぶ (led_timer を直接操作するため)。
+ * 再生中と同じパターンを指定した場合は、続きから再生する。
+ * --------------------------------------------------------------------------- */
+void led_set(unsigned char state) {
+    if (led_anim != NULL) {
+        led_anim = NULL;
+        timer_stop_body(&led_timer);
+    }
+    led_write(state);
+}
+
+void led_play(const LedPattern *pattern) {
+    if (led_anim == pattern) return;
+
+    timer_stop_body(&led_timer);
+    led_anim = pattern;
+    led_start = mtk_now_cycles();
+    led_write(pattern->frames[0]);
+    /* 1コマの間に2回以上見る (コマの境目の前後に呼ばれてもコマを飛ばさない) */
+    led_timer.period = MTK_MS_TO_TICKS((pattern->hold_ms + 1) / 2);
+    led_timer.expire = led_timer.period;
+    timer_start_body(&led_timer);
+}
+
+/* ---------------------------------------------------------------------------
+ * 関数名 : turbo_update
+ * 概要   : 時間経過監視と難易度・LED制御 (ストップウォッチ方式)
+ * 詳細   : 
+ * カーネルのソフトウェアタイマから呼ばれる
+ * (hard_clock の中で呼ばれるので、短時間で終わり、ブロックしないこと)。
+ * タイマはフェーズが変わる毎に turbo_phase が次の tick で呼ぶよう登録し、
+ * プレイ中は TURBO_UPDATE_PERIOD tick 毎に呼ばれ続ける。それ以外のフェーズでは
+ * 1回処理したらタイマを止める (プレイ中以外はターボ管理で起床しない)。
+ * プレイ中の場合のみ時間を累積する (mtk_now_cycles で測った実時間)。
+ * 累積時間に基づいて難易度レベルを決定し、落下速度とスコア倍率を更新する。
+ * また、レベルに応じて LED の表示 (レベルメーター / MAX時の点滅) を切り替える
+ * (点滅のコマ送りは LED ドライバのタイマが行う)。
+ * --------------------------------------------------------------------------- */
+MtkTimer turbo_timer;
+
+void turbo_update(void *arg) {
+    static unsigned long play_cycles = 0; /* 累積経過時間 (mtk_now_cycles のカウント数) */
+    static unsigned long last_cycles;     /* 前回累積した時刻 */
+    static int counting = 0;              /* last_cycles が有効 (プレイ中に1回以上呼ばれた) */
+    unsigned long now = mtk_now_cycles();
+
+    (void)arg;
+
+    /* --- 状態に応じた処理 --- */
+    switch (g_system_phase) {
+        case PHASE_IDLE:
+        case PHASE_COUNTDOWN:
+            /* リセット状態: 時間を0に戻し、LEDを消灯 */
+            play_cycles = (unsigned long)TURBO_START_SEC * MTK_TIMER_HZ;
+            counting = 0;
+            g_current_drop_interval = TURBO_BASE_INTERVAL;
+            g_score_multiplier = 1;
+            led_set(0);
+            timer_stop_body(&turbo_timer);
+            return;
+
+        case PHASE_PLAYING:
+            /* プレイ中: 前回からの実時間を加算してLED更新へ */
+            /* (tick は周期動作では skipmt でも進むので、時間には使わない) */
+            if (counting) play_cycles += now - last_cycles;
+            if (play_cycles > (unsigned long)TURBO_MAX_LEVEL_TIME_SEC * MTK_TIMER_HZ) {
+                play_cycles = (unsigned long)TURBO_MAX_LEVEL_TIME_SEC * MTK_TIMER_HZ;
             }
-            
-            for (i = 0; i < 8; i++) *leds[i] = flash_state ? '#' : ' ';
-        }
+            last_cycles = now;
+            counting = 1;
+            break;
+
+        case PHASE_RESULT:
+            /* 結果表示中: 時間は進めず、LEDの状態は維持 (MAX時の点滅は LED ドライバが続ける) */
+        default:
+            counting = 0;
+            timer_stop_body(&turbo_timer);
+            return;
+    }
 
-        /* 待機 */
-        unsigned long wake = tick + TURBO_UPDATE_PERIOD;
-        while (tick < wake) skipmt();
+    /* --- レベル計算とパラメータ更新 --- */
+    /* 秒換算 */
+    unsigned long elapsed_sec = play_cycles / MTK_TIMER_HZ;
+    
+    /* レベル計算: (経過秒 / MAX到達秒) * 8 */
+    int level = (elapsed_sec * 8) / TURBO_MAX_LEVEL_TIME_SEC;
+    if (level > 8) level = 8;
+
+    /* パラメータ適用 (定数を使用) */
+    switch (level) {
+        case 0: case 1: case 2: /* 通常 */
+            g_current_drop_interval = TURBO_BASE_INTERVAL;
+            g_score_multiplier = 1;
+            break;
+        case 3: case 4: case 5: /* 高速 (1.5倍) */
+            g_current_drop_interval = (TURBO_BASE_INTERVAL * 2) / 3;
+            g_score_multiplier = 2;
+            break;
+        case 6: case 7:         /* ターボ (3.0倍) */
+            g_current_drop_interval = TURBO_BASE_INTERVAL / 3;
+            g_score_multiplier = 4;
+            break;
+        case 8:                 /* MAX (6.0倍) */
+            g_current_drop_interval = TURBO_BASE_INTERVAL / 6;
+            g_score_multiplier = 8;
+            break;
+    }
+
+    /* LED出力 (変化がなければレジスタには書かない) */
+    if (level < 8) {
+        led_set(LED_BAR(level)); /* 通常時はレベルメーター表示 */
+    } else {
+        led_play(&led_max_blink); /* MAX時の点滅演出 */
     }
 }
 
+/* ---------------------------------------------------------------------------
+ * 関数名 : turbo_phase
+ * 概要   : システムフェーズを切り替え、ターボ管理に知らせる (タスクから呼ぶ)
+ * 詳細   : 
+ * 次の tick で turbo_update が新しいフェーズを処理するようタイマを登録し直す。
+ * --------------------------------------------------------------------------- */
+void turbo_phase(int phase) {
+    g_system_phase = phase;
+    mtk_timer_start(&turbo_timer, 0, TURBO_UPDATE_PERIOD, turbo_update, NULL);
+}
+
 /* ***************************************************************************
  * 12. メインエントリ
  * *************************************************************************** */
 
-/* プレイヤー1用タスク */
-void task1(void) {
-    TetrisGame game1;
-    game1.port_id = 0; game1.fp_out = com0out;
-    game1.sync_generation = 0; all_games[0] = &game1; 
-    wait_start(&game1);
-    while(1) { run_tetris(&game1); }
+/* ---------------------------------------------------------------------------
+ * 関数名 : task_game
+ * 概要   : プレイヤー用タスク (全プレイヤー共通)
+ * 詳細   : 
+ * main はプレイヤーのタスクを player_table の順に最初に登録するので、
+ * タスクID 1, 2, ... がそれぞれ Player 1, 2, ... (ポート 0, 1, ...) になる。
+ * --------------------------------------------------------------------------- */
+void task_game(void) {
+    TetrisGame game;
+    int port = curr_task - 1;
+    const PlayerConfig *cfg = &player_table[port];
+
+    game.port_id = port; game.fp_out = player_out[port];
+    game.color_profile = cfg->color_profile;
+    game.rival_view = RIVAL_VIEW_FULL;
+    game.scroll_accel = SCROLL_ACCEL_DEFAULT;
+    game.sync_generation = 0; game.frame_no = 0; game.tx_rate = 0;
+    game.snap_seq = 0; game.pub_score = game.pub_lines = 0;
+    memset((void *)game.garbage_sent, 0, sizeof(game.garbage_sent));
+    game.match_seed = 0; game.is_gameover = 0; game.target = -1;
+    game.bot_aps = (BOT_PORTS & (1 << port)) ? BOT_APS : 0;
+    memset((void *)game.row_stamp, 0, sizeof(game.row_stamp));
+    memset((void *)game.row_chg_base, 0, sizeof(game.row_chg_base));
+    memset(game.displayBuffer, 0, sizeof(game.displayBuffer));
+    all_games[port] = &game;
+    wait_start(&game);
+    while(1) { run_tetris(&game); }
 }
 
-/* プレイヤー2用タスク */
-void task2(void) {
-    TetrisGame game2;
-    game2.port_id = 1; game2.fp_out = com1out;
-    game2.sync_generation = 0; all_games[1] = &game2;
-    wait_start(&game2);
-    while(1) { run_tetris(&game2); }
+#if NUM_SPECTATORS > 0
+/* ---------------------------------------------------------------------------
+ * 関数名 : task_spectator
+ * 概要   : 観戦ポート (Port NUM_PLAYERS 以降) への配信タスク
+ * 詳細   : 
+ * 全ての観戦ポートを1つのタスクで受け持ち、配信リングから各ポートへ
+ * SPEC_CHUNK バイトずつ交互に送る。どのポートにも送るものがなければ CPU を譲る。
+ * --------------------------------------------------------------------------- */
+void task_spectator(void) {
+    int s, sent;
+
+    for (s = 0; s < NUM_SPECTATORS; s++) spec_banner(&spectators[s]);
+    while (1) {
+        sent = 0;
+        for (s = 0; s < NUM_SPECTATORS; s++) sent += spec_pump(&spectators[s]);
+        if (!sent) skipmt();
+    }
 }
+#endif
 
 /* メイン関数 */
 int main(void) {
+    int p;
+
     /* カーネル初期化 */
     init_kernel();
-    
-    /* セマフォ初期化 */
-    semaphore[SEM_GARBAGE_LOCK].count = 1;
+    init_cell_seq();
 
-    /* ストリーム初期化 (csys68k.cに依存) */
-    com0in  = fdopen(0, "r"); com0out = fdopen(1, "w");
-    com1in  = fdopen(4, "r"); com1out = fdopen(4, "w");
-    
-    /* タスク登録 */
-    set_task(task1);
-    set_task(task2);
-    set_task(task_turbo_monitor); 
+    /* ストリーム初期化 (csys68k.cに依存) と プレイヤータスク登録 */
+    /* プレイヤーのタスクはタスクID 1 から順に割り当てる (task_game 参照) */
+    for (p = 0; p < NUM_PLAYERS; p++) {
+        player_out[p] = fdopen(player_table[p].fd, "w");
+        set_task(task_game);
+    }
+    led_init(); /* ターボ管理のタイマは turbo_phase が登録する */
+
+#if NUM_SPECTATORS > 0
+    /* 観戦ポート: プレイヤーのポートへの送信を配信リングに写す */
+    for (p = NUM_PLAYERS; p < NUMPORT; p++) {
+        Spectator *sp = &spectators[p - NUM_PLAYERS];
+        sp->port = p; sp->player = -1; sp->waiting_key = 0;
+        sp->fp = fdopen(player_table[p].fd, "w");
+    }
+    for (p = 0; p < NUM_PLAYERS; p++) port_tap[p] = spec_tap;
+    set_task(task_spectator);
+#endif
     
     /* マルチタスク開始 */
     begin_sch();
     return 0; /* ここには到達しない */
-}
\ No newline at end of file
+}
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+# ===================================================================
+# trace2chrome.py
+# カーネルのイベントトレース (MTK_TRACE) を Chrome の trace_event 形式に変換する
+#
+# 概要:
+# リトライ画面で 'T' を押すと、ポートに次の形式でトレースが書き出される
+# (mtk_c.c の mtk_trace_dump)。
+#     MTKTRACE BEGIN hz=10000 records=N lost=M
+#     T 時刻 イベント タスク 引数
+#     ...
+#     MTKTRACE END
+# 端末のログ (エスケープシーケンスを含んでよい) から最後の書き出しを取り出し、
+# タスク毎の実行区間 (切り替えから切り替えまで) と、その他のイベントを
+# 瞬間イベントとして JSON に変換する。chrome://tracing や Perfetto で開ける。
+#
+# 使い方:
+#     python3 trace2chrome.py [--name 1=P1 --name 2=P2 ...] [ログ] > trace.json
+# (ログを省略すると標準入力から読む)
+# ===================================================================
+import argparse
+import json
+import re
+import sys
+
+# mtk_c.h の TRACE_xxx と同じ番号
+TRACE_SWITCH = 1
+TRACE_SCHED = 2
+TRACE_P = 3
+TRACE_V = 4
+TRACE_SLEEP = 5
+TRACE_WAKEUP = 6
+TRACE_DELAY = 7
+TRACE_CLOCK = 8
+TRACE_MARK = 9
+
+# 瞬間イベントの名前 (引数の意味を添える)
+EVENT_LABELS = {
+    TRACE_SCHED: ("sched", "next"),
+    TRACE_P: ("P", "sem"),
+    TRACE_V: ("V", "sem"),
+    TRACE_SLEEP: ("sleep", "sem"),
+    TRACE_WAKEUP: ("wakeup", "task"),
+    TRACE_DELAY: ("delay", "ticks"),
+    TRACE_CLOCK: ("hard_clock", "tick"),
+    TRACE_MARK: ("mark", "id"),
+}
+
+ESC_RE = re.compile(r"\x1b\[[0-9;?]*[A-Za-z]")
+
+
+def read_last_dump(lines):
+    """ログから最後の書き出しの (hz, 記録の並び) を取り出す"""
+    hz, records, current = None, None, None
+    for line in lines:
+        line = ESC_RE.sub("", line).strip("\r\n ")
+        m = re.search(r"MTKTRACE BEGIN hz=(\d+)", line)
+        if m:
+            current = (int(m.group(1)), [])
+            continue
+        if current is None:
+            continue
+        if line.endswith("MTKTRACE END"):
+            hz, records = current
+            current = None
+            continue
+        fields = line.split()
+        if len(fields) == 5 and fields[0] == "T":
+            current[1].append(tuple(int(f) for f in fields[1:]))
+    if records is None:
+        sys.exit("trace2chrome: no complete MTKTRACE dump found")
+    return hz, records
+
+
+def to_chrome(hz, records, names):
+    events = [{"ph": "M", "pid": 1, "name": "process_name", "args": {"name": "mtk"}}]
+    tasks = set()
+    base, last_raw, offset = None, None, 0
+    running, since, t_us = None, None, 0.0
+
+    for raw, event, task, arg in records:
+        # 時刻 (32bit で折り返す TCN1 の積算) を µs に直す
+        if last_raw is not None and raw < last_raw:
+            offset += 1 << 32
+        last_raw = raw
+        cycles = raw + offset
+        if base is None:
+            base = cycles
+        t_us = (cycles - base) * 1e6 / hz
+
+        if running is None:
+            running, since = task, t_us
+        tasks.add(task)
+
+        if event == TRACE_SWITCH:
+            events.append({"ph": "X", "pid": 1, "tid": running, "name": "run",
+                           "ts": since, "dur": t_us - since})
+            running, since = arg, t_us
+            tasks.add(arg)
+            continue
+
+        name, key = EVENT_LABELS.get(event, ("event%d" % event, "arg"))
+        events.append({"ph": "i", "s": "t", "pid": 1, "tid": task,
+                       "name": "%s %d" % (name, arg), "ts": t_us, "args": {key: arg}})
+
+    if running is not None:
+        events.append({"ph": "X", "pid": 1, "tid": running, "name": "run",
+                       "ts": since, "dur": t_us - since})
+    for task in sorted(tasks):
+        events.append({"ph": "M", "pid": 1, "tid": task, "name": "thread_name",
+                       "args": {"name": names.get(task, "task %d" % task)}})
+    return {"traceEvents": events, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="MTK_TRACE dump -> Chrome trace_event JSON")
+    parser.add_argument("log", nargs="?", help="captured terminal log (default: stdin)")
+    parser.add_argument("--name", action="append", default=[], metavar="ID=NAME",
+                        help="display name of a task (e.g. 1=P1)")
+    args = parser.parse_args()
+
+    names = {}
+    for item in args.name:
+        task, _, name = item.partition("=")
+        names[int(task)] = name
+
+    if args.log:
+        with open(args.log, encoding="utf-8", errors="replace") as f:
+            hz, records = read_last_dump(f)
+    else:
+        hz, records = read_last_dump(sys.stdin)
+    json.dump(to_chrome(hz, records, names), sys.stdout)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()